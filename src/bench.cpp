@@ -0,0 +1,491 @@
+#include "core.h"
+#include "random.h"
+#include "scene.h"
+#include "swc.h"
+
+#include <omp.h>
+
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+namespace {
+
+/**
+ * @brief The number of rays along each side of the grid traced over the bounds of a scene.
+ * */
+constexpr size_t trace_resolution{ 1024 };
+
+/**
+ * @brief The number of times each trace is repeated. The fastest one is reported, to keep out warm up costs.
+ * */
+constexpr size_t trace_repeats{ 3 };
+
+/**
+ * @brief The number of bytes Embree currently has allocated on the device, kept by @ref monitor_memory.
+ * */
+std::atomic<ssize_t> device_bytes{ 0 };
+
+auto
+monitor_memory(void*, const ssize_t bytes, const bool) -> bool
+{
+  // Frees come in as negative sizes, so the sum is what is still allocated.
+  device_bytes += bytes;
+  return true;
+}
+
+/**
+ * @brief A morphology being generated, with one array per field as @ref SWCModel::load_from_arrays takes them.
+ * */
+struct Morphology final
+{
+  Array<int32_t> ids;
+
+  Array<uint8_t> types;
+
+  Array<float> positions;
+
+  Array<float> radii;
+
+  Array<int32_t> parents;
+
+  bool failed{ false };
+
+  /**
+   * @brief Adds a node.
+   *
+   * @return The ID of the new node. Once adding a node failed, @ref Morphology::failed is set.
+   * */
+  auto add(const SWCType type, const Vec3f& p, const float radius, const int32_t parent) -> int32_t
+  {
+    const auto id = static_cast<int32_t>(ids.size() + 1);
+
+    auto* node_id = ids.append();
+    auto* node_type = types.append();
+    auto* node_radius = radii.append();
+    auto* node_parent = parents.append();
+
+    if (!node_id || !node_type || !node_radius || !node_parent || !positions.reserve(positions.size() + 3)) {
+      failed = true;
+      return parent;
+    }
+
+    *node_id = id;
+    *node_type = static_cast<uint8_t>(type);
+    *node_radius = radius;
+    *node_parent = parent;
+
+    for (size_t i = 0; i < 3; i++) {
+      *positions.append() = p[i];
+    }
+
+    return id;
+  }
+
+  [[nodiscard]] auto load(SWCModel* model) const -> bool
+  {
+    if (failed) {
+      return false;
+    }
+
+    return model->load_from_arrays(
+      ids.size(), ids.data(), types.data(), positions.data(), radii.data(), parents.data());
+  }
+};
+
+[[nodiscard]] auto
+normalize(const Vec3f& v) -> Vec3f
+{
+  const auto l = length(v);
+  return (l > 0.0F) ? (v * (1.0F / l)) : Vec3f{ 1.0F, 0.0F, 0.0F };
+}
+
+/**
+ * @brief Grows a balanced binary tree of straight branches, which is the synthetic morphology.
+ * */
+void
+grow_binary_tree(Morphology* m, int32_t parent, Vec3f p, const Vec3f& dir, const float radius, const size_t depth)
+{
+  constexpr size_t nodes_per_branch{ 10 };
+
+  constexpr float step{ 2.0F };
+
+  for (size_t i = 0; i < nodes_per_branch; i++) {
+    p = p + dir * step;
+    parent = m->add(SWCType::BASAL_DENDRITE, p, radius, parent);
+  }
+
+  if (depth == 0) {
+    return;
+  }
+
+  // Each child turns by about 30 degrees to either side, and rises or sinks a little.
+  const Vec3f side{ -dir[1], dir[0], 0.0F };
+  const Vec3f rise{ 0.0F, 0.0F, 0.25F };
+
+  grow_binary_tree(m, parent, p, normalize(dir + side * 0.6F + rise), radius * 0.8F, depth - 1);
+  grow_binary_tree(m, parent, p, normalize(dir - side * 0.6F - rise), radius * 0.8F, depth - 1);
+}
+
+[[nodiscard]] auto
+make_synthetic(SWCModel* model) -> bool
+{
+  Morphology m;
+
+  const auto soma = m.add(SWCType::SOMA, Vec3f{ 0.0F, 0.0F, 0.0F }, 10.0F, -1);
+
+  for (size_t i = 0; i < 4; i++) {
+    const auto angle = static_cast<float>(i) * 1.5707963F;
+    const Vec3f dir{ cosf(angle), sinf(angle), 0.0F };
+    grow_binary_tree(&m, soma, dir * 10.0F, dir, 2.0F, 10);
+  }
+
+  return m.load(model);
+}
+
+/**
+ * @brief Grows a dendritic arbor by random walks that taper and branch, which stands in for a traced neuron when no
+ *        file is given.
+ * */
+[[nodiscard]] auto
+make_typical(SWCModel* model) -> bool
+{
+  struct Tip final
+  {
+    int32_t parent;
+
+    Vec3f position;
+
+    Vec3f direction;
+
+    float radius;
+  };
+
+  Morphology m;
+
+  Random rng(42);
+
+  const auto jitter = [&rng]() -> Vec3f {
+    return Vec3f{ rng.next_float() - 0.5F, rng.next_float() - 0.5F, (rng.next_float() - 0.5F) * 0.5F };
+  };
+
+  const auto soma = m.add(SWCType::SOMA, Vec3f{ 0.0F, 0.0F, 0.0F }, 8.0F, -1);
+
+  Array<Tip> tips;
+
+  for (size_t i = 0; i < 7; i++) {
+    const auto angle = static_cast<float>(i) * 0.8975979F;
+    const Vec3f dir{ cosf(angle), sinf(angle), 0.0F };
+    auto* tip = tips.append();
+    if (!tip) {
+      return false;
+    }
+    *tip = Tip{ soma, dir * 8.0F, dir, 1.5F };
+  }
+
+  constexpr size_t max_nodes{ 40000 };
+
+  while ((tips.size() > 0) && (m.ids.size() < max_nodes)) {
+
+    auto tip = tips[tips.size() - 1];
+
+    tips.pop_back();
+
+    while ((tip.radius > 0.15F) && (m.ids.size() < max_nodes)) {
+
+      tip.direction = normalize(tip.direction + jitter() * 0.4F);
+      tip.position = tip.position + tip.direction;
+      tip.radius *= 0.996F;
+      tip.parent = m.add(SWCType::BASAL_DENDRITE, tip.position, tip.radius, tip.parent);
+
+      if (rng.next_float() < 0.006F) {
+        auto* branch = tips.append();
+        if (!branch) {
+          return false;
+        }
+        *branch = Tip{ tip.parent, tip.position, normalize(tip.direction + jitter()), tip.radius * 0.8F };
+      }
+    }
+  }
+
+  return m.load(model);
+}
+
+/**
+ * @brief Traces a grid of rays straight down over the bounds of a scene, like a capture without the shading.
+ *
+ * @return The number of rays that hit something.
+ * */
+[[nodiscard]] auto
+trace_grid(const Scene& scene) -> size_t
+{
+  const auto bounds = scene.get_bounds();
+
+  const auto packet_size = scene.packet_size();
+
+  const auto dx = (bounds.upper_x - bounds.lower_x) / static_cast<float>(trace_resolution);
+  const auto dy = (bounds.upper_y - bounds.lower_y) / static_cast<float>(trace_resolution);
+
+  size_t hits = 0;
+
+#pragma omp parallel for reduction(+ : hits)
+
+  for (ssize_t y = 0; y < static_cast<ssize_t>(trace_resolution); y++) {
+
+    Vec2f points[16];
+
+    unsigned int geom_ids[16];
+
+    for (size_t x = 0; x < trace_resolution; x += packet_size) {
+
+      const auto count = ((trace_resolution - x) < packet_size) ? (trace_resolution - x) : packet_size;
+
+      for (size_t i = 0; i < count; i++) {
+        points[i] = Vec2f{ bounds.lower_x + (static_cast<float>(x + i) + 0.5F) * dx,
+                           bounds.lower_y + (static_cast<float>(y) + 0.5F) * dy };
+      }
+
+      scene.intersect_down(points, count, bounds.upper_z + 1.0F, geom_ids, nullptr);
+
+      for (size_t i = 0; i < count; i++) {
+        hits += (geom_ids[i] != RTC_INVALID_GEOMETRY_ID) ? 1 : 0;
+      }
+    }
+  }
+
+  return hits;
+}
+
+/**
+ * @brief Traces the grid a few times over, see @ref trace_repeats.
+ *
+ * @return The fastest time, in seconds.
+ * */
+[[nodiscard]] auto
+time_trace(const Scene& scene, size_t* hits) -> double
+{
+  auto best = static_cast<double>(INFINITY);
+
+  for (size_t i = 0; i < trace_repeats; i++) {
+    const auto start = omp_get_wtime();
+    *hits = trace_grid(scene);
+    const auto t = omp_get_wtime() - start;
+    best = (t < best) ? t : best;
+  }
+
+  return best;
+}
+
+[[nodiscard]] auto
+quality_name(const RTCBuildQuality quality) -> const char*
+{
+  switch (quality) {
+    case RTC_BUILD_QUALITY_LOW:
+      return "low";
+    case RTC_BUILD_QUALITY_MEDIUM:
+      return "medium";
+    case RTC_BUILD_QUALITY_HIGH:
+      return "high";
+    default:
+      break;
+  }
+  return "refit";
+}
+
+/**
+ * @brief Builds and traces a model under every build quality and every combination of the BVH flags.
+ * */
+[[nodiscard]] auto
+bench_configs(const char* name, const SWCModel& model) -> bool
+{
+  const RTCBuildQuality qualities[]{ RTC_BUILD_QUALITY_LOW, RTC_BUILD_QUALITY_MEDIUM, RTC_BUILD_QUALITY_HIGH };
+
+  for (const auto quality : qualities) {
+
+    for (unsigned int flags = 0; flags < 8; flags++) {
+
+      SceneConfig config;
+      config.build_quality = quality;
+      config.instance_build_quality = quality;
+      config.compact = (flags & 1) != 0;
+      config.robust = (flags & 2) != 0;
+      config.dynamic = (flags & 4) != 0;
+
+      Scene scene(default_device());
+
+      scene.set_config(config);
+
+      const auto build_start = omp_get_wtime();
+
+      if (scene.add_neuron(model, Transform{}) == RTC_INVALID_GEOMETRY_ID) {
+        fprintf(stderr, "failed to build %s\n", name);
+        return false;
+      }
+
+      scene.commit();
+
+      const auto build_time = omp_get_wtime() - build_start;
+
+      size_t hits = 0;
+
+      const auto trace_time = time_trace(scene, &hits);
+
+      const auto num_rays = static_cast<double>(trace_resolution * trace_resolution);
+
+      printf("%-10s %-7s %-8s %-7s %-8s %10.2f %10.2f %10.2f %10zu\n",
+             name,
+             quality_name(quality),
+             config.compact ? "compact" : "-",
+             config.robust ? "robust" : "-",
+             config.dynamic ? "dynamic" : "-",
+             build_time * 1000.0,
+             trace_time * 1000.0,
+             num_rays / trace_time * 1.0e-6,
+             hits);
+    }
+  }
+
+  return true;
+}
+
+[[nodiscard]] auto
+curve_name(const NeuriteCurve curve) -> const char*
+{
+  switch (curve) {
+    case NeuriteCurve::LINEAR:
+      return "linear";
+    case NeuriteCurve::CATMULL_ROM:
+      return "catmull-rom";
+    case NeuriteCurve::BSPLINE:
+      return "bspline";
+  }
+  return "";
+}
+
+/**
+ * @brief Compares the neurite curve types on primitive count, on the size of what Embree builds for them and on trace
+ *        time.
+ *
+ * @details The primitives are the curves plus the short runs kept as linear segments, against the SWC edges of the
+ *          linear path. The size is what the device allocates while the scene is built, which is mostly the BVH, but
+ *          also takes in any buffers Embree owns, such as the control points of the splines.
+ * */
+[[nodiscard]] auto
+bench_curves(const char* name, const SWCModel& model) -> bool
+{
+  const NeuriteCurve curves[]{ NeuriteCurve::LINEAR, NeuriteCurve::CATMULL_ROM, NeuriteCurve::BSPLINE };
+
+  size_t num_edges = 0;
+
+  size_t num_vertices = 0;
+
+  model.count_neurite_geometry(&num_edges, &num_vertices);
+
+  for (const auto curve : curves) {
+
+    SceneConfig config;
+    config.neurite_curve = curve;
+
+    Scene scene(default_device());
+
+    scene.set_config(config);
+
+    const auto bytes_before = device_bytes.load();
+
+    const auto build_start = omp_get_wtime();
+
+    if (scene.add_neuron(model, Transform{}) == RTC_INVALID_GEOMETRY_ID) {
+      fprintf(stderr, "failed to build %s\n", name);
+      return false;
+    }
+
+    scene.commit();
+
+    const auto build_time = omp_get_wtime() - build_start;
+
+    const auto bytes = device_bytes.load() - bytes_before;
+
+    size_t hits = 0;
+
+    const auto trace_time = time_trace(scene, &hits);
+
+    const auto& geometry = scene.neuron_geometry(0);
+
+    const auto num_short = geometry.short_neurites().num_primitives;
+
+    printf("%-10s %-12s %10zu %10zu %10zu %10.1f %10.2f %10.2f %10zu\n",
+           name,
+           curve_name(curve),
+           num_edges,
+           geometry.neurites().num_primitives + num_short,
+           num_short,
+           static_cast<double>(bytes) / 1024.0,
+           build_time * 1000.0,
+           trace_time * 1000.0,
+           hits);
+  }
+
+  return true;
+}
+
+} // namespace
+
+/**
+ * @brief Times how long the scene takes to build and trace under each build configuration, and then compares the
+ *        neurite curve types.
+ *
+ * @details Usage: neuroscope_bench [typical.swc]. The typical morphology is generated when no file is given.
+ * */
+auto
+main(int argc, char** argv) -> int
+{
+  rtcSetDeviceMemoryMonitorFunction(default_device(), monitor_memory, nullptr);
+
+  SWCModel synthetic;
+
+  SWCModel typical;
+
+  if (!make_synthetic(&synthetic)) {
+    fprintf(stderr, "failed to generate the synthetic morphology\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((argc > 1) ? !typical.load_from_file(argv[1]) : !make_typical(&typical)) {
+    fprintf(stderr, "failed to load the typical morphology\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%-10s %-7s %-8s %-7s %-8s %10s %10s %10s %10s\n",
+         "model",
+         "quality",
+         "compact",
+         "robust",
+         "dynamic",
+         "build_ms",
+         "trace_ms",
+         "mrays/s",
+         "hits");
+
+  if (!bench_configs("synthetic", synthetic) || !bench_configs("typical", typical)) {
+    return EXIT_FAILURE;
+  }
+
+  printf("\n%-10s %-12s %10s %10s %10s %10s %10s %10s %10s\n",
+         "model",
+         "curve",
+         "edges",
+         "primitives",
+         "linear",
+         "embree_kb",
+         "build_ms",
+         "trace_ms",
+         "hits");
+
+  if (!bench_curves("synthetic", synthetic) || !bench_curves("typical", typical)) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
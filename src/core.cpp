@@ -2,6 +2,17 @@
 
 auto
 Transform::apply(const Vec3f& p) const -> Vec3f
+{
+  float m[12];
+  to_matrix(m);
+
+  return Vec3f{ m[0] * p[0] + m[1] * p[1] + m[2] * p[2] + m[3],
+                m[4] * p[0] + m[5] * p[1] + m[6] * p[2] + m[7],
+                m[8] * p[0] + m[9] * p[1] + m[10] * p[2] + m[11] };
+}
+
+void
+Transform::to_matrix(float* m) const
 {
   const auto cx = cosf(rotation[0]);
   const auto sx = sinf(rotation[0]);
@@ -10,21 +21,18 @@ Transform::apply(const Vec3f& p) const -> Vec3f
   const auto cz = cosf(rotation[2]);
   const auto sz = sinf(rotation[2]);
 
-  const auto m00 = cy * cz;
-  const auto m01 = cy * sz;
-  const auto m02 = -sy;
-
-  const auto m10 = sx * sy * cz - cx * sz;
-  const auto m11 = sx * sy * sz + cx * cz;
-  const auto m12 = sx * cy;
-
-  const auto m20 = cx * sy * cz + sx * sz;
-  const auto m21 = cx * sy * sz - sx * cz;
-  const auto m22 = cx * cy;
+  m[0] = cy * cz;
+  m[1] = cy * sz;
+  m[2] = -sy;
+  m[3] = position[0];
 
-  const Vec3f r{ m00 * p[0] + m01 * p[1] + m02 * p[2],
-                 m10 * p[0] + m11 * p[1] + m12 * p[2],
-                 m20 * p[0] + m21 * p[1] + m22 * p[2] };
+  m[4] = sx * sy * cz - cx * sz;
+  m[5] = sx * sy * sz + cx * cz;
+  m[6] = sx * cy;
+  m[7] = position[1];
 
-  return r + position;
+  m[8] = cx * sy * cz + sx * sz;
+  m[9] = cx * sy * sz - sx * cz;
+  m[10] = cx * cy;
+  m[11] = position[2];
 }
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 template<typename T>
 [[nodiscard]] constexpr auto
@@ -98,30 +99,111 @@ class Array final
 
   size_t size_{};
 
+  size_t capacity_{};
+
 public:
   Array() = default;
 
   Array(Array&& other)
     : elements_(other.elements_)
     , size_(other.size_)
+    , capacity_(other.capacity_)
   {
     other.elements_ = nullptr;
     other.size_ = 0;
+    other.capacity_ = 0;
   }
 
   ~Array() { free(elements_); }
 
+  auto operator=(Array&& other) -> Array&
+  {
+    if (this != &other) {
+      free(elements_);
+      elements_ = other.elements_;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.elements_ = nullptr;
+      other.size_ = 0;
+      other.capacity_ = 0;
+    }
+    return *this;
+  }
+
+  Array(const Array&) = delete;
+
+  auto operator=(const Array&) -> Array& = delete;
+
   [[nodiscard]] auto resize(const size_t size) -> bool
   {
+    if (size == 0) {
+      free(elements_);
+      elements_ = nullptr;
+      size_ = 0;
+      capacity_ = 0;
+      return true;
+    }
     void* result = realloc(elements_, size * sizeof(T));
     if (!result) {
       return false;
     }
     elements_ = static_cast<T*>(result);
     size_ = size;
+    capacity_ = size;
+    return true;
+  }
+
+  /**
+   * @brief Ensures that at least @p capacity elements can be appended without reallocating.
+   * */
+  [[nodiscard]] auto reserve(const size_t capacity) -> bool
+  {
+    if (capacity <= capacity_) {
+      return true;
+    }
+    void* result = realloc(elements_, capacity * sizeof(T));
+    if (!result) {
+      return false;
+    }
+    elements_ = static_cast<T*>(result);
+    capacity_ = capacity;
     return true;
   }
 
+  /**
+   * @brief Adds an uninitialized element to the end of the array, growing the storage geometrically.
+   *
+   * @return A pointer to the new element, or null if the storage could not be grown.
+   * */
+  [[nodiscard]] auto append() -> T*
+  {
+    if ((size_ == capacity_) && !reserve((capacity_ < 16) ? 16 : (capacity_ * 2))) {
+      return nullptr;
+    }
+    size_++;
+    return &elements_[size_ - 1];
+  }
+
+  /**
+   * @brief Removes the last element, keeping the storage.
+   * */
+  void pop_back()
+  {
+    if (size_ > 0) {
+      size_--;
+    }
+  }
+
+  /**
+   * @brief Releases any storage beyond the current size.
+   * */
+  void shrink_to_fit()
+  {
+    if (size_ < capacity_) {
+      (void)resize(size_);
+    }
+  }
+
   [[nodiscard]] auto data() -> T* { return elements_; }
 
   [[nodiscard]] auto data() const -> const T* { return elements_; }
@@ -133,6 +215,77 @@ public:
   [[nodiscard]] auto operator[](const size_t i) -> T& { return elements_[i]; }
 };
 
+/**
+ * @brief The alignment used for data that is meant to be streamed through vector registers.
+ * */
+constexpr size_t cache_line_size{ 64 };
+
+/**
+ * @brief A block of untyped, cache line aligned memory.
+ * */
+class AlignedBuffer final
+{
+  void* data_{};
+
+  size_t size_{};
+
+public:
+  AlignedBuffer() = default;
+
+  AlignedBuffer(AlignedBuffer&& other)
+    : data_(other.data_)
+    , size_(other.size_)
+  {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  ~AlignedBuffer() { free(data_); }
+
+  auto operator=(AlignedBuffer&& other) -> AlignedBuffer&
+  {
+    if (this != &other) {
+      free(data_);
+      data_ = other.data_;
+      size_ = other.size_;
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+    return *this;
+  }
+
+  AlignedBuffer(const AlignedBuffer&) = delete;
+
+  auto operator=(const AlignedBuffer&) -> AlignedBuffer& = delete;
+
+  /**
+   * @brief Replaces the block with a zeroed one of the given size. The previous contents are not preserved.
+   * */
+  [[nodiscard]] auto allocate(const size_t size) -> bool
+  {
+    free(data_);
+    data_ = nullptr;
+    size_ = 0;
+    if (size == 0) {
+      return true;
+    }
+    const auto padded_size = (size + cache_line_size - 1) / cache_line_size * cache_line_size;
+    data_ = aligned_alloc(cache_line_size, padded_size);
+    if (!data_) {
+      return false;
+    }
+    memset(data_, 0, padded_size);
+    size_ = size;
+    return true;
+  }
+
+  [[nodiscard]] auto data() -> void* { return data_; }
+
+  [[nodiscard]] auto data() const -> const void* { return data_; }
+
+  [[nodiscard]] auto size() const -> size_t { return size_; }
+};
+
 struct Transform final
 {
   Vec3f position;
@@ -140,4 +293,9 @@ struct Transform final
   Vec3f rotation;
 
   [[nodiscard]] auto apply(const Vec3f& p) const -> Vec3f;
+
+  /**
+   * @brief Gets the transform as a row major 3x4 matrix, with the translation in the last column.
+   * */
+  void to_matrix(float* m) const;
 };
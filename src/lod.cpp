@@ -0,0 +1,230 @@
+#include "lod.h"
+
+#include "core.h"
+#include "swc.h"
+
+#include <stdint.h>
+
+namespace {
+
+enum class NodeState : uint8_t
+{
+  /**
+   * @brief Left out along with its subtree, either as part of a twig or because it cannot be reached from a root.
+   * */
+  PRUNED,
+  /**
+   * @brief Merged into the segment from its nearest kept ancestor to its descendants.
+   * */
+  MERGED,
+  KEPT
+};
+
+/**
+ * @brief The most nodes that are merged into a single segment, which bounds the cost of checking the tolerance.
+ * */
+constexpr size_t max_merged_nodes{ 64 };
+
+[[nodiscard]] auto
+node_vertex(const SWCModel& model, const size_t i) -> Vec4f
+{
+  return Vec4f{ model.x()[i], model.y()[i], model.z()[i], model.radii()[i] };
+}
+
+[[nodiscard]] auto
+node_distance(const SWCModel& model, const size_t i, const size_t j) -> float
+{
+  return length(Vec3f{ model.x()[i] - model.x()[j], model.y()[i] - model.y()[j], model.z()[i] - model.z()[j] });
+}
+
+[[nodiscard]] auto
+dot(const Vec4f& a, const Vec4f& b) -> float
+{
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+}
+
+/**
+ * @brief The distance from a node to a segment, with the radius treated as a fourth coordinate. This way a node is
+ *        only merged away if both its position and its thickness are close to the segment.
+ * */
+[[nodiscard]] auto
+distance_to_segment(const Vec4f& p, const Vec4f& a, const Vec4f& b) -> float
+{
+  const auto ab = b - a;
+  const auto ab_length2 = dot(ab, ab);
+  const auto t = (ab_length2 > 0.0F) ? clamp(dot(p - a, ab) / ab_length2, 0.0F, 1.0F) : 0.0F;
+  return length(p - (a + ab * t));
+}
+
+} // namespace
+
+auto
+simplify_model(const SWCModel& model, const float pixel_size, const LODConfig& config, SWCModel* result) -> bool
+{
+  const auto num_nodes = model.num_nodes();
+  const auto* order = model.preorder();
+  const auto order_size = model.preorder_size();
+  const auto* types = model.types();
+  const auto* parents = model.parent_indices();
+
+  const auto tolerance = config.collinear_tolerance * pixel_size;
+  const auto min_twig_length = config.min_twig_length * pixel_size;
+  const auto max_segment_length = config.max_segment_length * pixel_size;
+
+  // The longest path from each node to a tip in its subtree, and the child that path goes through.
+  Array<float> extents;
+
+  Array<uint32_t> longest_children;
+
+  Array<NodeState> states;
+
+  Array<uint32_t> num_kept_children;
+
+  // The nearest ancestor of each node that is kept, or the node itself if it is kept.
+  Array<uint32_t> anchors;
+
+  if (!extents.resize(num_nodes) || !longest_children.resize(num_nodes) || !states.resize(num_nodes) ||
+      !num_kept_children.resize(num_nodes) || !anchors.resize(num_nodes)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < num_nodes; i++) {
+    extents[i] = 0.0F;
+    longest_children[i] = SWCModel::invalid_index;
+    states[i] = NodeState::PRUNED;
+    num_kept_children[i] = 0;
+    anchors[i] = SWCModel::invalid_index;
+  }
+
+  // Walking the pre-order backwards visits every child before its parent.
+  for (size_t k = order_size; k-- > 0;) {
+    const auto i = order[k];
+    const auto parent = parents[i];
+    if (parent == SWCModel::invalid_index) {
+      continue;
+    }
+    const auto extent = extents[i] + node_distance(model, i, parent);
+    if ((longest_children[parent] == SWCModel::invalid_index) || (extent > extents[parent])) {
+      extents[parent] = extent;
+      longest_children[parent] = i;
+    }
+  }
+
+  /* Twigs are pruned first, since a branch point that loses all but one of its branches becomes part of an
+   * unbranched run that can be merged.
+   */
+
+  for (size_t k = 0; k < order_size; k++) {
+    const auto i = order[k];
+    const auto parent = parents[i];
+    if (parent == SWCModel::invalid_index) {
+      states[i] = NodeState::KEPT;
+      continue;
+    }
+    if (states[parent] == NodeState::PRUNED) {
+      continue;
+    }
+    const auto twig = (types[i] != SWCType::SOMA) && (longest_children[parent] != i) &&
+                      ((extents[i] + node_distance(model, i, parent)) < min_twig_length);
+    if (!twig) {
+      states[i] = NodeState::KEPT;
+      num_kept_children[parent]++;
+    }
+  }
+
+  for (size_t k = 0; k < order_size; k++) {
+
+    const auto i = order[k];
+
+    if (states[i] == NodeState::PRUNED) {
+      continue;
+    }
+
+    anchors[i] = i;
+
+    const auto parent = parents[i];
+
+    if ((parent == SWCModel::invalid_index) || (types[i] == SWCType::SOMA) || (num_kept_children[i] != 1) ||
+        (types[parent] != types[i])) {
+      continue;
+    }
+
+    size_t next = SWCModel::invalid_index;
+
+    for (size_t c = 0; c < model.num_children(i); c++) {
+      const auto child = model.children(i)[c];
+      next = (states[child] != NodeState::PRUNED) ? child : next;
+    }
+
+    if (types[next] != types[i]) {
+      continue;
+    }
+
+    const auto anchor = anchors[parent];
+
+    auto merge = node_distance(model, anchor, i) < pixel_size;
+
+    if (!merge && (node_distance(model, anchor, next) <= max_segment_length)) {
+
+      const auto a = node_vertex(model, anchor);
+      const auto b = node_vertex(model, next);
+
+      merge = distance_to_segment(node_vertex(model, i), a, b) <= tolerance;
+
+      // The nodes merged into the segment so far have to stay within the tolerance of the longer segment too.
+      size_t num_merged = 1;
+
+      for (auto j = parent; merge && (j != anchor); j = parents[j]) {
+        merge = (++num_merged <= max_merged_nodes) && (distance_to_segment(node_vertex(model, j), a, b) <= tolerance);
+      }
+    }
+
+    if (merge) {
+      states[i] = NodeState::MERGED;
+      anchors[i] = anchor;
+    }
+  }
+
+  size_t num_kept = 0;
+
+  for (size_t i = 0; i < num_nodes; i++) {
+    num_kept += (states[i] == NodeState::KEPT) ? 1 : 0;
+  }
+
+  Array<int32_t> ids;
+
+  Array<uint8_t> kept_types;
+
+  Array<float> positions;
+
+  Array<float> radii;
+
+  Array<int32_t> kept_parents;
+
+  if (!ids.resize(num_kept) || !kept_types.resize(num_kept) || !positions.resize(num_kept * 3) ||
+      !radii.resize(num_kept) || !kept_parents.resize(num_kept)) {
+    return false;
+  }
+
+  size_t offset = 0;
+
+  // Writing the nodes in index order keeps them sorted by ID.
+  for (size_t i = 0; i < num_nodes; i++) {
+    if (states[i] != NodeState::KEPT) {
+      continue;
+    }
+    const auto parent = parents[i];
+    ids[offset] = model.ids()[i];
+    kept_types[offset] = static_cast<uint8_t>(types[i]);
+    positions[offset * 3 + 0] = model.x()[i];
+    positions[offset * 3 + 1] = model.y()[i];
+    positions[offset * 3 + 2] = model.z()[i];
+    radii[offset] = model.radii()[i];
+    kept_parents[offset] =
+      (parent != SWCModel::invalid_index) ? model.ids()[anchors[parent]] : model.parents()[i];
+    offset++;
+  }
+
+  return result->load_from_arrays(
+    num_kept, ids.data(), kept_types.data(), positions.data(), radii.data(), kept_parents.data());
+}
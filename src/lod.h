@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+class SWCModel;
+
+/**
+ * @brief Options for @ref simplify_model. Lengths are given in pixels, so the same options work at any magnification.
+ * */
+struct LODConfig final
+{
+  /**
+   * @brief Whether microscopes simplify the models they capture. Calling @ref simplify_model ignores this.
+   * */
+  bool enabled{ false };
+
+  /**
+   * @brief How far a node may be from the straight segment that replaces it, taking the radius into account too.
+   * */
+  float collinear_tolerance{ 0.25F };
+
+  /**
+   * @brief Side branches shorter than this are dropped. The longest branch at each branch point is always kept.
+   * */
+  float min_twig_length{ 1.0F };
+
+  /**
+   * @brief Merged segments are not made longer than this, which keeps the bounding boxes of the segments tight.
+   * */
+  float max_segment_length{ 16.0F };
+};
+
+/**
+ * @brief Builds a simplified copy of a model for imaging at the given pixel size.
+ *
+ * @details Side branches that are shorter than @ref LODConfig::min_twig_length are dropped, and then runs of
+ *          unbranched nodes are merged into longer segments as long as the dropped nodes stay within
+ *          @ref LODConfig::collinear_tolerance of them. Nodes that are less than a pixel away from the previous
+ *          node that was kept are always merged, so the number of segments is bounded by the length of the neuron in
+ *          pixels instead of by the sampling of the reconstruction.
+ *
+ *          Soma nodes, branch points, tips and changes of type are kept, and nodes keep their IDs. Nodes that cannot
+ *          be reached from a root are left out.
+ *
+ * @param pixel_size The size of a pixel, in the units of the model.
+ * @param result Receives the simplified model.
+ * */
+[[nodiscard]] auto
+simplify_model(const SWCModel& model, float pixel_size, const LODConfig& config, SWCModel* result) -> bool;
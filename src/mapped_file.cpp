@@ -0,0 +1,191 @@
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * @brief The alignment of a file that is read rather than mapped. It matches the column alignment of the binary SWC
+ *        format, so its columns can be used in place just as they are from a mapping.
+ * */
+constexpr size_t read_alignment{ 64 };
+
+/**
+ * @brief Reads a file descriptor to its end into a buffer that grows geometrically.
+ *
+ * @param data Receives the buffer, to be released with free, or null if nothing was read.
+ * */
+[[nodiscard]] auto
+read_all(const int fd, void** data, size_t* size) -> bool
+{
+  constexpr size_t initial_capacity{ 64 * 1024 };
+
+  void* buffer{};
+
+  size_t capacity = 0;
+
+  size_t used = 0;
+
+  for (;;) {
+
+    if (used == capacity) {
+      const auto grown_capacity = (capacity == 0) ? initial_capacity : (capacity * 2);
+      void* grown = aligned_alloc(read_alignment, grown_capacity);
+      if (!grown) {
+        free(buffer);
+        return false;
+      }
+      if (used > 0) {
+        memcpy(grown, buffer, used);
+      }
+      free(buffer);
+      buffer = grown;
+      capacity = grown_capacity;
+    }
+
+    const auto n = ::read(fd, static_cast<char*>(buffer) + used, capacity - used);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      free(buffer);
+      return false;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    used += static_cast<size_t>(n);
+  }
+
+  if (used == 0) {
+    free(buffer);
+    buffer = nullptr;
+  }
+
+  *data = buffer;
+  *size = used;
+
+  return true;
+}
+
+[[nodiscard]] auto
+to_advice(const MappedFileAccess access) -> int
+{
+  switch (access) {
+    case MappedFileAccess::SEQUENTIAL:
+      return MADV_SEQUENTIAL;
+    case MappedFileAccess::NORMAL:
+      break;
+    case MappedFileAccess::RANDOM:
+      return MADV_RANDOM;
+  }
+  return MADV_NORMAL;
+}
+
+} // namespace
+
+MappedFile::MappedFile(const MappedFileAccess access)
+  : access_(access)
+{
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+  : data_(other.data_)
+  , size_(other.size_)
+  , access_(other.access_)
+  , mapped_(other.mapped_)
+{
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+auto
+MappedFile::operator=(MappedFile&& other) -> MappedFile&
+{
+  if (this != &other) {
+    close();
+    data_ = other.data_;
+    size_ = other.size_;
+    access_ = other.access_;
+    mapped_ = other.mapped_;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+auto
+MappedFile::open(const char* path) -> bool
+{
+  close();
+
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info{};
+
+  if (fstat(fd, &info) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // Pipes and devices have no size to map, so they are read through instead.
+  if (!S_ISREG(info.st_mode)) {
+    const auto ok = read_all(fd, &data_, &size_);
+    ::close(fd);
+    mapped_ = false;
+    return ok;
+  }
+
+  const auto size = static_cast<size_t>(info.st_size);
+
+  if (size == 0) {
+    ::close(fd);
+    return true;
+  }
+
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // The mapping keeps its own reference to the file.
+  ::close(fd);
+
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  madvise(data, size, to_advice(access_));
+
+  data_ = data;
+  size_ = size;
+  mapped_ = true;
+
+  return true;
+}
+
+void
+MappedFile::close()
+{
+  if (data_ && mapped_) {
+    munmap(data_, size_);
+  } else {
+    free(data_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * @brief How a mapped file is going to be read, which is passed on to the kernel as advice.
+ * */
+enum class MappedFileAccess
+{
+  /**
+   * @brief Read once, front to back. Pages are read ahead aggressively and may be dropped soon after.
+   * */
+  SEQUENTIAL,
+  /**
+   * @brief No particular pattern. The default read-ahead, and pages are kept around.
+   * */
+  NORMAL,
+  /**
+   * @brief Scattered reads, with no read-ahead.
+   * */
+  RANDOM
+};
+
+/**
+ * @brief A read-only memory mapping of an entire file.
+ *
+ * @details Files that cannot be mapped, such as pipes, character devices and process substitutions, are read into
+ *          memory instead, so anything that can be opened can be loaded.
+ * */
+class MappedFile final
+{
+  void* data_{};
+
+  size_t size_{};
+
+  MappedFileAccess access_{ MappedFileAccess::SEQUENTIAL };
+
+  /**
+   * @brief Whether the data is a mapping, as opposed to a buffer the file was read into.
+   * */
+  bool mapped_{ false };
+
+public:
+  MappedFile() = default;
+
+  explicit MappedFile(MappedFileAccess access);
+
+  MappedFile(MappedFile&& other);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+
+  auto operator=(const MappedFile&) -> MappedFile& = delete;
+
+  auto operator=(MappedFile&& other) -> MappedFile&;
+
+  /**
+   * @brief Maps the file at the given path, replacing any previous mapping. A file that is not a regular file is
+   *        read to its end instead.
+   *
+   * @note An empty file is opened successfully and has a null data pointer.
+   * */
+  [[nodiscard]] auto open(const char* path) -> bool;
+
+  void close();
+
+  [[nodiscard]] auto data() const -> const char* { return static_cast<const char*>(data_); }
+
+  [[nodiscard]] auto size() const -> size_t { return size_; }
+};
@@ -1,17 +1,59 @@
 #include "microscope.h"
 
+#include "lod.h"
 #include "random.h"
+#include "raster.h"
 #include "scene.h"
 #include "swc.h"
 #include "tissue.h"
 
-MicroscopeBase::MicroscopeBase()
+#include <omp.h>
+
+namespace {
+
+/**
+ * @brief Gathers the even bits of a Morton code, which make up one of its two coordinates.
+ * */
+[[nodiscard]] auto
+compact_bits(uint32_t v) -> uint32_t
+{
+  v &= 0x55555555u;
+  v = (v | (v >> 1)) & 0x33333333u;
+  v = (v | (v >> 2)) & 0x0f0f0f0fu;
+  v = (v | (v >> 4)) & 0x00ff00ffu;
+  v = (v | (v >> 8)) & 0x0000ffffu;
+  return v;
+}
+
+/**
+ * @brief The part of the view that a pixel covers, in world space.
+ * */
+[[nodiscard]] auto
+pixel_rect(const ClipRect& view, const size_t x, const size_t y, const size_t w, const size_t h) -> ClipRect
+{
+  const auto x_scale = (view.upper_x - view.lower_x) / static_cast<float>(w);
+  const auto y_scale = (view.upper_y - view.lower_y) / static_cast<float>(h);
+  return ClipRect{ view.lower_x + static_cast<float>(x) * x_scale,
+                   view.lower_y + static_cast<float>(y) * y_scale,
+                   view.lower_x + static_cast<float>(x + 1) * x_scale,
+                   view.lower_y + static_cast<float>(y + 1) * y_scale };
+}
+
+} // namespace
+
+MicroscopeBase::MicroscopeBase(const size_t image_width, const size_t image_height, const float vertical_fov)
   : device_(rtcNewDevice(""))
+  , image_width_(image_width)
+  , image_height_(image_height)
+  , vertical_fov_(vertical_fov)
 {
 }
 
 MicroscopeBase::MicroscopeBase(MicroscopeBase&& other)
   : device_(other.device_)
+  , image_width_(other.image_width_)
+  , image_height_(other.image_height_)
+  , vertical_fov_(other.vertical_fov_)
 {
   rtcSetDeviceErrorFunction(
     device_,
@@ -37,26 +79,179 @@ MicroscopeBase::device() -> RTCDevice
   return device_;
 }
 
+auto
+MicroscopeBase::pixel_size() const -> float
+{
+  return vertical_fov_ / static_cast<float>(image_height_);
+}
+
+auto
+MicroscopeBase::view_rect() const -> ClipRect
+{
+  const auto aspect{ static_cast<float>(image_width_) / static_cast<float>(image_height_) };
+  const auto fov{ vertical_fov_ * 0.5F };
+  return ClipRect{ -fov * aspect, -fov, fov * aspect, fov };
+}
+
 auto
 MicroscopeBase::capture(const SWCModel& model, const Tissue& tissue, const Transform& t) -> bool
 {
   Scene scene(device());
 
-  if (!scene.from_swc_model(model, t)) {
+  scene.set_config(scene_config_);
+
+  if (scene_config_.clip_to_view) {
+    auto clip = view_rect();
+    clip.lower_x -= scene_config_.clip_margin;
+    clip.lower_y -= scene_config_.clip_margin;
+    clip.upper_x += scene_config_.clip_margin;
+    clip.upper_y += scene_config_.clip_margin;
+    scene.set_clip_rect(clip);
+  }
+
+  SWCModel simplified;
+
+  if (lod_config_.enabled && !simplify_model(model, pixel_size(), lod_config_, &simplified)) {
+    return false;
+  }
+
+  if (!scene.from_swc_model(lod_config_.enabled ? simplified : model, t)) {
+    return false;
+  }
+
+  return run_capture(scene, tissue);
+}
+
+auto
+MicroscopeBase::capture(const Scene& scene, const Tissue& tissue) -> bool
+{
+  return run_capture(scene, tissue);
+}
+
+auto
+MicroscopeBase::run_capture(const Scene& scene, const Tissue& tissue) -> bool
+{
+  if (capturing_.exchange(true)) {
     return false;
   }
 
   capture_impl(scene, tissue);
 
+  capturing_ = false;
+
+  return true;
+}
+
+void
+MicroscopeBase::set_scene_config(const SceneConfig& config)
+{
+  scene_config_ = config;
+}
+
+void
+MicroscopeBase::set_lod_config(const LODConfig& config)
+{
+  lod_config_ = config;
+}
+
+void
+MicroscopeBase::set_tile_config(const TileConfig& config)
+{
+  tile_config_ = config;
+}
+
+auto
+MicroscopeBase::plan_tiles(const size_t width, const size_t height, Array<CaptureTile>* tiles) const -> bool
+{
+  const size_t tile_size = (tile_config_.tile_size > 0) ? tile_config_.tile_size : 1;
+
+  const auto tiles_x = (width + tile_size - 1) / tile_size;
+  const auto tiles_y = (height + tile_size - 1) / tile_size;
+
+  // Morton codes are built from 16 bits per axis.
+  if ((tiles_x > 0xffffu) || (tiles_y > 0xffffu) || !tiles->resize(tiles_x * tiles_y)) {
+    (void)tiles->resize(0);
+    return false;
+  }
+
+  /* Walking the codes in order, and skipping the ones outside of the image, gives the tiles in Morton order without
+   * having to sort them. The codes run up to the enclosing power of two square at most.
+   */
+
+  size_t count = 0;
+
+  for (uint32_t code = 0; count < tiles->size(); code++) {
+
+    const size_t tx = compact_bits(code);
+    const size_t ty = compact_bits(code >> 1);
+
+    if ((tx >= tiles_x) || (ty >= tiles_y)) {
+      continue;
+    }
+
+    auto& tile = (*tiles)[count++];
+    tile.x = static_cast<uint32_t>(tx * tile_size);
+    tile.y = static_cast<uint32_t>(ty * tile_size);
+    tile.width = static_cast<uint32_t>(((tile.x + tile_size) < width) ? tile_size : (width - tile.x));
+    tile.height = static_cast<uint32_t>(((tile.y + tile_size) < height) ? tile_size : (height - tile.y));
+    tile.seconds = 0.0F;
+    tile.thread = 0;
+  }
+
+  return true;
+}
+
+void
+MicroscopeBase::store_tiles(Array<CaptureTile>& tiles)
+{
+  const std::lock_guard<std::mutex> lock(tiles_mutex_);
+
+  tiles_ = std::move(tiles);
+}
+
+auto
+MicroscopeBase::copy_tiles(Array<CaptureTile>* tiles) const -> bool
+{
+  const std::lock_guard<std::mutex> lock(tiles_mutex_);
+
+  if (!tiles->resize(tiles_.size())) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tiles_.size(); i++) {
+    (*tiles)[i] = tiles_[i];
+  }
+
   return true;
 }
 
+auto
+MicroscopeBase::tile_clock() const -> double
+{
+  return tile_config_.record_timings ? omp_get_wtime() : 0.0;
+}
+
+void
+MicroscopeBase::finish_tile(CaptureTile* tile, const double start) const
+{
+  if (tile_config_.record_timings) {
+    tile->seconds = static_cast<float>(omp_get_wtime() - start);
+    tile->thread = omp_get_thread_num();
+  }
+}
+
 SegmentationMicroscope::SegmentationMicroscope(const size_t image_width,
                                                const size_t image_height,
                                                const float vertical_fov)
-  : sensor_(image_width, image_height)
-  , vertical_fov_(vertical_fov)
+  : MicroscopeBase(image_width, image_height, vertical_fov)
+  , sensor_(image_width, image_height)
+{
+}
+
+void
+SegmentationMicroscope::set_config(const SegmentationConfig& config)
 {
+  config_ = config;
 }
 
 void
@@ -66,59 +261,178 @@ SegmentationMicroscope::capture_impl(const Scene& scene, const Tissue&)
   const auto h = sensor_.height();
   auto* pixels = sensor_.get_array_data();
 
+  // The ray tracer is the fallback if the rasterizer runs out of memory.
+  if ((config_.backend == SegmentationBackend::RASTERIZATION) &&
+      rasterize_segmentation(scene, vertical_fov(), w, h, tile_config().tile_size, pixels)) {
+    return;
+  }
+
   const auto x_scale{ 1.0F / static_cast<float>(w) };
   const auto y_scale{ 1.0F / static_cast<float>(h) };
   const auto aspect{ static_cast<float>(w) / static_cast<float>(h) };
-  const auto fov{ vertical_fov_ * 0.5F };
-  const auto max_spp{ 16 };
+  const auto fov{ vertical_fov() * 0.5F };
+  constexpr size_t max_spp{ 16 };
   const auto elevation{ 1.0e6F };
+  const auto view = view_rect();
+  const auto packet_size = scene.packet_size();
 
-#pragma omp parallel for
+  // Gets the first samples of a pixel, which are the same whatever the number of samples is.
+  const auto sample_pixel = [&](const size_t x, const size_t y, Vec2f* points, const size_t count) {
+    Random rng(y * w + x);
 
-  for (ssize_t y = 0; y < static_cast<ssize_t>(h); y++) {
+    for (size_t i = 0; i < count; i++) {
 
-    auto* row = pixels + y * w * 3;
+      const auto u = (static_cast<float>(x) + rng.next_float()) * x_scale;
+      const auto v = (static_cast<float>(y) + rng.next_float()) * y_scale;
 
-    for (size_t x = 0; x < w; x++) {
+      points[i] = Vec2f{ (u * 2.0F - 1.0F) * fov * aspect, (v * 2.0F - 1.0F) * fov };
+    }
+  };
 
-      int r{ 0 };
-      int g{ 0 };
-      int b{ 255 };
+  const auto trace_pixel = [&](const size_t x, const size_t y) -> unsigned int {
+    if (!scene.may_overlap(pixel_rect(view, x, y, w, h))) {
+      return RTC_INVALID_GEOMETRY_ID;
+    }
 
-      Random rng(y * w + x);
+    Vec2f points[max_spp];
 
-      for (int i = 0; i < max_spp; i++) {
+    unsigned int geom_ids[max_spp];
 
-        const auto u = (static_cast<float>(x) + rng.next_float()) * x_scale;
-        const auto v = (static_cast<float>(y) + rng.next_float()) * y_scale;
+    sample_pixel(x, y, points, max_spp);
 
-        const auto px = (u * 2.0F - 1.0F) * fov * aspect;
-        const auto py = (v * 2.0F - 1.0F) * fov;
+    /* The first sample that hits something decides the label, so the samples are traced a packet at a time, and the
+     * rest are skipped once one of them hits. Most covered pixels are decided by the first packet.
+     */
 
-        const auto isect = scene.intersect1(Vec3f{ px, py, elevation }, Vec3f{ 0, 0, -1 });
+    for (size_t first = 0; first < max_spp; first += packet_size) {
 
-        if (isect.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-          b = 0;
-          if (scene.is_neurite(isect.hit.geomID)) {
-            g = 255;
-          } else {
-            r = 255;
-          }
-          break;
+      const auto count = ((max_spp - first) < packet_size) ? (max_spp - first) : packet_size;
+
+      scene.intersect_down(points + first, count, elevation, geom_ids + first, nullptr);
+
+      for (size_t i = first; i < first + count; i++) {
+        if (geom_ids[i] != RTC_INVALID_GEOMETRY_ID) {
+          return geom_ids[i];
         }
       }
+    }
+
+    return RTC_INVALID_GEOMETRY_ID;
+  };
+
+  const auto write_label = [&](const size_t x, const size_t y, const unsigned int geom_id) {
+    int r{ 0 };
+    int g{ 0 };
+    int b{ 255 };
 
-      auto* pixel = row + x * 3;
-      pixel[0] = r;
-      pixel[1] = g;
-      pixel[2] = b;
+    if (geom_id != RTC_INVALID_GEOMETRY_ID) {
+      b = 0;
+      if (scene.is_neurite(geom_id)) {
+        g = 255;
+      } else {
+        r = 255;
+      }
     }
+
+    auto* pixel = pixels + (y * w + x) * 3;
+    pixel[0] = r;
+    pixel[1] = g;
+    pixel[2] = b;
+  };
+
+  Array<unsigned int> first_hits;
+
+  if (!config_.adaptive || !first_hits.resize(w * h)) {
+    for_each_tile(w, h, [&](const CaptureTile& tile) {
+      for (size_t y = tile.y; y < tile.y + tile.height; y++) {
+        for (size_t x = tile.x; x < tile.x + tile.width; x++) {
+          write_label(x, y, trace_pixel(x, y));
+        }
+      }
+    });
+    return;
   }
+
+  /* If the first sample of a pixel hits something, it decides the label of the pixel, so tracing just that sample
+   * labels most of the pixels covered by the neuron. A pixel that the first sample misses in can only be covered if it
+   * overlaps an occupied cell, which trace_pixel checks, and it is most likely on the edge of a primitive if a nearby
+   * first sample hit, so only those pixels are traced with all of the samples.
+   */
+
+  for_each_tile(w, h, [&](const CaptureTile& tile) {
+    for (size_t y = tile.y; y < tile.y + tile.height; y++) {
+
+      // The first samples of a run of pixels in a row are traced together, as a packet.
+      for (size_t x = tile.x; x < tile.x + tile.width; x += max_spp) {
+
+        const auto count = clamp<size_t>(tile.x + tile.width - x, 1, max_spp);
+
+        auto* geom_ids = first_hits.data() + y * w + x;
+
+        auto rect = pixel_rect(view, x, y, w, h);
+
+        rect.upper_x = pixel_rect(view, x + count - 1, y, w, h).upper_x;
+
+        if (!scene.may_overlap(rect)) {
+          for (size_t i = 0; i < count; i++) {
+            geom_ids[i] = RTC_INVALID_GEOMETRY_ID;
+          }
+          continue;
+        }
+
+        Vec2f points[max_spp];
+
+        for (size_t i = 0; i < count; i++) {
+          sample_pixel(x + i, y, points + i, 1);
+        }
+
+        scene.intersect_down(points, count, elevation, geom_ids, nullptr);
+      }
+    }
+  });
+
+  const auto k = config_.refine_distance;
+
+  const auto has_hit_nearby = [&](const size_t x, const size_t y) -> bool {
+    if (k == 0) {
+      return true;
+    }
+
+    const auto x0 = (x > k) ? (x - k) : 0;
+    const auto y0 = (y > k) ? (y - k) : 0;
+    const auto x1 = ((w - 1 - x) > k) ? (x + k) : (w - 1);
+    const auto y1 = ((h - 1 - y) > k) ? (y + k) : (h - 1);
+
+    for (auto ny = y0; ny <= y1; ny++) {
+      for (auto nx = x0; nx <= x1; nx++) {
+        if (first_hits[ny * w + nx] != RTC_INVALID_GEOMETRY_ID) {
+          return true;
+        }
+      }
+    }
+
+    return false;
+  };
+
+  for_each_tile(w, h, [&](const CaptureTile& tile) {
+    for (size_t y = tile.y; y < tile.y + tile.height; y++) {
+      for (size_t x = tile.x; x < tile.x + tile.width; x++) {
+
+        auto geom_id = first_hits[y * w + x];
+
+        if ((geom_id == RTC_INVALID_GEOMETRY_ID) && has_hit_nearby(x, y)) {
+          geom_id = trace_pixel(x, y);
+        }
+
+        write_label(x, y, geom_id);
+      }
+    }
+  });
 }
 
 FluorescenceMicroscope::FluorescenceMicroscope(size_t image_width, size_t image_height, float vertical_fov)
-  : sensor_(image_width, image_height)
-  , vertical_fov_(vertical_fov)
+  : MicroscopeBase(image_width, image_height, vertical_fov)
+  , sensor_(image_width, image_height)
 {
   fluorescence_.SetFrequency(0.1F);
   fluorescence_.SetNoiseType(FastNoiseLite::NoiseType_Perlin);
@@ -142,54 +456,72 @@ FluorescenceMicroscope::capture_impl(const Scene& scene, const Tissue& tissue)
   const auto x_scale{ 1.0F / static_cast<float>(w) };
   const auto y_scale{ 1.0F / static_cast<float>(h) };
   const auto aspect{ static_cast<float>(w) / static_cast<float>(h) };
-  const auto fov{ vertical_fov_ * 0.5F };
+  const auto fov{ vertical_fov() * 0.5F };
   constexpr auto spp{ 16 };
 
-  const auto bounds = scene.get_bounds();
+  /* The depth of a hit is measured from the top of the unclipped neurons, so that clipping does not change the image.
+   * The rays start above whatever was built, which spline neurites can take a little past the nodes.
+   */
+  const auto bounds = scene.unclipped_bounds();
   const auto z_scale = 1.0F / (bounds.upper_z - bounds.lower_z);
+  const auto built_top = scene.get_bounds().upper_z;
+  const auto origin_z = (built_top > bounds.upper_z) ? built_top : bounds.upper_z;
+  const auto view = view_rect();
 
-#pragma omp parallel for
+  for_each_tile(w, h, [&](const CaptureTile& tile) {
+    for (size_t y = tile.y; y < tile.y + tile.height; y++) {
 
-  for (ssize_t y = 0; y < static_cast<ssize_t>(h); y++) {
+      auto* row = pixels + y * w;
 
-    auto* row = pixels + y * w;
+      for (size_t x = tile.x; x < tile.x + tile.width; x++) {
 
-    for (size_t x = 0; x < w; x++) {
+        Random rng(x + y * w);
 
-      Random rng(x + y * w);
+        float intensity_sum{ 0.0F };
 
-      float intensity_sum{ 0.0F };
+        Vec2f points[spp];
 
-      for (int j = 0; j < spp; ++j) {
+        unsigned int geom_ids[spp];
 
-        const float u = (static_cast<float>(x) + rng.next_float()) * x_scale;
-        const float v = (static_cast<float>(y) + rng.next_float()) * y_scale;
+        float distances[spp];
 
-        const float px = (u * 2.0F - 1.0F) * fov * aspect;
-        const float py = (v * 2.0F - 1.0F) * fov;
+        for (int j = 0; j < spp; ++j) {
 
-        const Vec3f ray_org{ px, py, bounds.upper_z };
-        const Vec3f ray_dir{ 0, 0, -1 };
+          const float u = (static_cast<float>(x) + rng.next_float()) * x_scale;
+          const float v = (static_cast<float>(y) + rng.next_float()) * y_scale;
 
-        const auto isect = scene.intersect1(ray_org, ray_dir);
+          points[j] = Vec2f{ (u * 2.0F - 1.0F) * fov * aspect, (v * 2.0F - 1.0F) * fov };
+        }
 
-        if (isect.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
-          intensity_sum += tissue.density(Vec2f{ px, py });
-          continue;
+        // The tissue is still sampled where there is nothing to trace.
+        if (scene.may_overlap(pixel_rect(view, x, y, w, h))) {
+          scene.intersect_down(points, spp, origin_z, geom_ids, distances);
+        } else {
+          for (int j = 0; j < spp; ++j) {
+            geom_ids[j] = RTC_INVALID_GEOMETRY_ID;
+          }
         }
 
-        const Vec3f hit_pos = ray_org + ray_dir * isect.ray.tfar;
+        for (int j = 0; j < spp; ++j) {
 
-        const float distance_intensity = 1.0F - isect.ray.tfar * z_scale;
+          if (geom_ids[j] == RTC_INVALID_GEOMETRY_ID) {
+            intensity_sum += tissue.density(points[j]);
+            continue;
+          }
 
-        const float emission = fluorescence_.GetNoise(hit_pos[0], hit_pos[1], hit_pos[2]) * 0.5F + 0.5F;
+          const Vec3f hit_pos{ points[j][0], points[j][1], origin_z - distances[j] };
 
-        intensity_sum += distance_intensity * clamp(emission, config_.min_emission, config_.max_emission);
-      }
+          const float distance_intensity = 1.0F - (bounds.upper_z - hit_pos[2]) * z_scale;
 
-      const float intensity_avg = intensity_sum * (1.0F / static_cast<float>(spp));
+          const float emission = fluorescence_.GetNoise(hit_pos[0], hit_pos[1], hit_pos[2]) * 0.5F + 0.5F;
 
-      row[x] = static_cast<int>(intensity_avg * 255);
+          intensity_sum += distance_intensity * clamp(emission, config_.min_emission, config_.max_emission);
+        }
+
+        const float intensity_avg = intensity_sum * (1.0F / static_cast<float>(spp));
+
+        row[x] = static_cast<int>(intensity_avg * 255);
+      }
     }
-  }
+  });
 }
@@ -1,14 +1,20 @@
 #pragma once
 
+#include "lod.h"
+#include "scene.h"
+
 #include <embree4/rtcore.h>
 
+#include <atomic>
+#include <mutex>
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include <FastNoiseLite.h>
 
 class SWCModel;
-class Scene;
 class Tissue;
 struct Transform;
 
@@ -60,20 +66,97 @@ public:
   auto operator=(ImageSensor&&) -> ImageSensor& = delete;
 };
 
+/**
+ * @brief How a capture is split into tiles of pixels, which are handed out to the threads as they become free.
+ * */
+struct TileConfig final
+{
+  /**
+   * @brief The width and height of a tile, in pixels.
+   * */
+  size_t tile_size{ 32 };
+
+  /**
+   * @brief Records how long each tile took and which thread rendered it, see @ref MicroscopeBase::tiles.
+   * */
+  bool record_timings{ false };
+};
+
+/**
+ * @brief A tile of a capture, along with how it was rendered when timings are recorded.
+ * */
+struct CaptureTile final
+{
+  uint32_t x{};
+
+  uint32_t y{};
+
+  uint32_t width{};
+
+  uint32_t height{};
+
+  float seconds{};
+
+  int thread{};
+};
+
 class Microscope
 {
 public:
   virtual ~Microscope() = default;
 
+  /**
+   * @brief Captures a model placed with the given transform.
+   *
+   * @note A microscope renders into a single sensor, so it takes one capture at a time. A capture started while
+   *       another one is running on the same microscope fails.
+   * */
   [[nodiscard]] virtual auto capture(const SWCModel&, const Tissue& tissue, const Transform& transform) -> bool = 0;
+
+  /**
+   * @brief Captures a scene that has already been built, which avoids rebuilding it for every capture.
+   * */
+  [[nodiscard]] virtual auto capture(const Scene& scene, const Tissue& tissue) -> bool = 0;
 };
 
 class MicroscopeBase : public Microscope
 {
   RTCDevice device_{};
 
+  size_t image_width_{};
+
+  size_t image_height_{};
+
+  /**
+   * @brief The height of the view, in world units.
+   * */
+  float vertical_fov_{ 100.0F };
+
+  SceneConfig scene_config_;
+
+  LODConfig lod_config_;
+
+  TileConfig tile_config_;
+
+  /**
+   * @brief The tiles of the last capture that finished, in the order they were handed out, which is Morton order.
+   *
+   * @details Each capture plans and times its own tiles, and only stores them here when it is done. The mutex lets
+   *          the tiles be copied out while the next capture is running.
+   * */
+  Array<CaptureTile> tiles_;
+
+  mutable std::mutex tiles_mutex_;
+
+  /**
+   * @brief Set while a capture is running, so that a second one fails instead of writing into the same sensor.
+   * */
+  std::atomic<bool> capturing_{ false };
+
+  [[nodiscard]] auto run_capture(const Scene& scene, const Tissue& tissue) -> bool;
+
 public:
-  MicroscopeBase();
+  MicroscopeBase(size_t image_width, size_t image_height, float vertical_fov);
 
   MicroscopeBase(MicroscopeBase&&);
 
@@ -87,21 +170,152 @@ public:
 
   auto capture(const SWCModel& model, const Tissue& tissue, const Transform& t) -> bool override;
 
+  auto capture(const Scene& scene, const Tissue& tissue) -> bool override;
+
+  /**
+   * @brief Sets the build options of the scenes that are built when a model is captured.
+   * */
+  void set_scene_config(const SceneConfig& config);
+
+  /**
+   * @brief Sets how models are simplified before they are captured. The simplification follows the size of a pixel,
+   *        so it adapts to the field of view and the image size.
+   * */
+  void set_lod_config(const LODConfig& config);
+
+  void set_tile_config(const TileConfig& config);
+
+  /**
+   * @brief Copies the tiles of the last capture that finished. The timings are only filled in if
+   *        @ref TileConfig::record_timings was set.
+   *
+   * @return False if the copy could not be allocated.
+   * */
+  [[nodiscard]] auto copy_tiles(Array<CaptureTile>* tiles) const -> bool;
+
 protected:
   [[nodiscard]] auto device() -> RTCDevice;
 
+  [[nodiscard]] auto vertical_fov() const -> float { return vertical_fov_; }
+
+  /**
+   * @brief The size of a pixel in world units.
+   * */
+  [[nodiscard]] auto pixel_size() const -> float;
+
+  /**
+   * @brief The part of the world XY plane that is imaged.
+   * */
+  [[nodiscard]] auto view_rect() const -> ClipRect;
+
   virtual void capture_impl(const Scene& scene, const Tissue& tissue) = 0;
+
+  [[nodiscard]] auto tile_config() const -> const TileConfig& { return tile_config_; }
+
+  /**
+   * @brief Calls the kernel for every tile of an image, concurrently.
+   *
+   * @details The tiles are walked in Morton order, so tiles that are handed out one after the other are close
+   *          together, and handed out one at a time to whichever thread is free. That keeps the threads busy when the
+   *          neuron only covers part of the image.
+   * */
+  template<typename Kernel>
+  void for_each_tile(const size_t width, const size_t height, const Kernel& kernel)
+  {
+    Array<CaptureTile> tiles;
+
+    if (!plan_tiles(width, height, &tiles)) {
+      kernel(CaptureTile{ 0, 0, static_cast<uint32_t>(width), static_cast<uint32_t>(height) });
+      store_tiles(tiles);
+      return;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+
+    for (ssize_t i = 0; i < static_cast<ssize_t>(tiles.size()); i++) {
+
+      const auto start = tile_clock();
+
+      kernel(tiles[i]);
+
+      finish_tile(&tiles[i], start);
+    }
+
+    store_tiles(tiles);
+  }
+
+private:
+  /**
+   * @brief Splits an image into tiles, in Morton order.
+   *
+   * @return False, with no tiles, if the image has too many tiles or they could not be allocated.
+   * */
+  [[nodiscard]] auto plan_tiles(size_t width, size_t height, Array<CaptureTile>* tiles) const -> bool;
+
+  /**
+   * @brief Replaces the tiles of the last capture with those of a capture that just finished.
+   * */
+  void store_tiles(Array<CaptureTile>& tiles);
+
+  [[nodiscard]] auto tile_clock() const -> double;
+
+  void finish_tile(CaptureTile* tile, double start) const;
+};
+
+/**
+ * @brief How the segmentation microscope renders its labels.
+ * */
+enum class SegmentationBackend
+{
+  /**
+   * @brief Traces 16 rays per pixel through the scene.
+   * */
+  RAY_TRACING,
+  /**
+   * @brief Tests the same samples against the projected primitives instead, see @ref rasterize_segmentation. Scenes
+   *        with spline neurites are still ray traced.
+   * */
+  RASTERIZATION
+};
+
+/**
+ * @note The rasterizer uses the tile size of @ref TileConfig, but not its schedule or timings.
+ * */
+struct SegmentationConfig final
+{
+  SegmentationBackend backend{ SegmentationBackend::RAY_TRACING };
+
+  /**
+   * @brief Traces the first sample of every pixel, and then all of the samples only in the pixels that were missed
+   *        but may still be covered, see @ref SegmentationConfig::refine_distance. Only applies to the ray tracer.
+   *
+   * @note The image is traced in two passes, and the tile timings are those of the second one.
+   * */
+  bool adaptive{ false };
+
+  /**
+   * @brief In adaptive mode, a pixel missed by its first sample is traced with all of its samples if its area overlaps
+   *        an occupied cell of the occupancy grid. By default that is all it takes, so the labels match the full trace
+   *        exactly.
+   *
+   * @details A distance above zero also requires the first sample of a pixel at most this many pixels away to have
+   *          hit something, which traces fewer pixels but is lossy: a feature thinner than a pixel is dropped where
+   *          the first samples miss it everywhere within this distance.
+   * */
+  size_t refine_distance{ 0 };
 };
 
 class SegmentationMicroscope : public MicroscopeBase
 {
   ImageSensor<uint8_t, 3> sensor_;
 
-  float vertical_fov_{ 100.0F };
+  SegmentationConfig config_;
 
 public:
   SegmentationMicroscope(size_t image_width, size_t image_height, float vertical_fov);
 
+  void set_config(const SegmentationConfig& config);
+
   [[nodiscard]] auto get_sensor() const -> const ImageSensor<uint8_t, 3>& { return sensor_; }
 
 protected:
@@ -121,8 +335,6 @@ class FluorescenceMicroscope : public MicroscopeBase
 {
   ImageSensor<uint8_t, 1> sensor_;
 
-  float vertical_fov_{ 100.0F };
-
   FastNoiseLite fluorescence_;
 
   FluorescenceConfig config_;
@@ -1,15 +1,103 @@
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 
+#include "lod.h"
 #include "microscope.h"
+#include "scene.h"
 #include "swc.h"
 #include "tissue.h"
 
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
 #include <stdlib.h>
 
 namespace {
 
 namespace py = pybind11;
 
+/**
+ * @brief Loads the given files concurrently, without holding the GIL.
+ *
+ * @return A tuple of the loaded models and, per model, whether it was loaded.
+ * */
+auto
+load_all(const std::vector<std::string>& paths) -> py::tuple
+{
+  std::vector<const char*> c_paths;
+  c_paths.reserve(paths.size());
+  for (const auto& path : paths) {
+    c_paths.emplace_back(path.c_str());
+  }
+
+  std::vector<SWCModel> models(paths.size());
+
+  std::unique_ptr<bool[]> results(new bool[paths.size()]);
+
+  {
+    py::gil_scoped_release release;
+    load_many(c_paths.data(), c_paths.size(), models.data(), results.get());
+  }
+
+  py::list model_list;
+  py::list result_list;
+
+  for (size_t i = 0; i < models.size(); i++) {
+    model_list.append(py::cast(std::move(models[i])));
+    result_list.append(results[i]);
+  }
+
+  return py::make_tuple(model_list, result_list);
+}
+
+/**
+ * @brief Wraps model memory in a read-only array that keeps its owner alive. Mapped models are not writable at all.
+ * */
+auto
+read_only_view(const py::dtype& dtype,
+               const std::vector<py::ssize_t>& shape,
+               const std::vector<py::ssize_t>& strides,
+               const void* data,
+               const py::handle& owner) -> py::array
+{
+  py::array view(dtype, shape, strides, data, owner);
+  view.attr("setflags")(py::arg("write") = false);
+  return view;
+}
+
+/**
+ * @brief Pins a model for as long as views of its columns exist, and keeps the Python object alive meanwhile.
+ *
+ * @return The owner to give to the views. The model is unpinned once the last of them is gone.
+ * */
+auto
+pin_model(const py::object& self) -> py::capsule
+{
+  self.cast<const SWCModel&>().pin();
+
+  // The capsule is only ever released with the GIL held, so the count and the reference are safe to touch.
+  return py::capsule(self.inc_ref().ptr(), [](void* ptr) {
+    const py::handle owner(static_cast<PyObject*>(ptr));
+    owner.cast<const SWCModel&>().unpin();
+    owner.dec_ref();
+  });
+}
+
+template<typename T>
+auto
+column_view(const T* column, const size_t size, const py::handle& owner) -> py::array
+{
+  return read_only_view(py::dtype::of<T>(),
+                        { static_cast<py::ssize_t>(size) },
+                        { static_cast<py::ssize_t>(sizeof(T)) },
+                        column,
+                        owner);
+}
+
 } // namespace
 
 PYBIND11_MODULE(neuroscope, m)
@@ -45,21 +133,433 @@ PYBIND11_MODULE(neuroscope, m)
 
   py::class_<SWCModel>(m, "SWCModel")
     .def(py::init<>())
+    .def(py::init([](const py::array_t<int32_t, py::array::c_style | py::array::forcecast>& ids,
+                     const py::array_t<uint8_t, py::array::c_style | py::array::forcecast>& types,
+                     const py::array_t<float, py::array::c_style | py::array::forcecast>& positions,
+                     const py::array_t<float, py::array::c_style | py::array::forcecast>& radii,
+                     const py::array_t<int32_t, py::array::c_style | py::array::forcecast>& parents) {
+           const auto n = static_cast<size_t>(ids.size());
+           // A (3, n) array has the right size too, but would be read in the wrong order.
+           if ((positions.ndim() != 2) || (positions.shape(1) != 3)) {
+             throw py::value_error("expected positions of shape (n, 3)");
+           }
+           if ((static_cast<size_t>(types.size()) != n) || (static_cast<size_t>(positions.shape(0)) != n) ||
+               (static_cast<size_t>(radii.size()) != n) || (static_cast<size_t>(parents.size()) != n)) {
+             throw py::value_error("expected one id, type, radius and parent and three coordinates per node");
+           }
+           auto model = std::make_unique<SWCModel>();
+           if (!model->load_from_arrays(n, ids.data(), types.data(), positions.data(), radii.data(), parents.data())) {
+             throw std::bad_alloc();
+           }
+           return model;
+         }),
+         py::arg("ids"),
+         py::arg("types"),
+         py::arg("positions"),
+         py::arg("radii"),
+         py::arg("parents"))
     .def("load_from_file", &SWCModel::load_from_file, py::arg("path"))
+    .def(
+      "load_from_memory",
+      [](SWCModel& self, const py::buffer& text) -> bool {
+        const auto info = text.request();
+        // The text is read as one run of bytes, so a strided view or wider items would be misread.
+        if ((info.itemsize != 1) || (info.ndim != 1) || (info.strides[0] != 1)) {
+          throw py::value_error("expected a contiguous buffer of bytes");
+        }
+        const auto size = static_cast<size_t>(info.size);
+        // The text is parsed into a model of its own, since other threads may use this one once the GIL is released.
+        SWCModel model;
+        bool loaded{ false };
+        {
+          py::gil_scoped_release release;
+          loaded = model.load_from_memory(static_cast<const char*>(info.ptr), size);
+        }
+        // Back under the GIL, so nothing can pin the model between the check and the replacement.
+        if (!loaded || self.is_pinned()) {
+          return false;
+        }
+        self = std::move(model);
+        return true;
+      },
+      py::arg("text"))
+    .def("load_binary", &SWCModel::load_binary, py::arg("path"))
+    .def("save_binary", &SWCModel::save_binary, py::arg("path"))
     .def("num_nodes", &SWCModel::num_nodes)
-    .def("find_node", [](const SWCModel& model, const int32_t key) -> std::unique_ptr<SWCNode> {
-      const auto* result = model.find_node(key);
-      if (result) {
-        return std::make_unique<SWCNode>(*result);
-      } else {
-        return nullptr;
+    .def("find_node",
+         [](const SWCModel& model, const int32_t key) -> std::unique_ptr<SWCNode> {
+           SWCNode node;
+           if (model.find_node(key, &node)) {
+             return std::make_unique<SWCNode>(node);
+           } else {
+             return nullptr;
+           }
+         })
+    .def("find_index",
+         [](const SWCModel& model, const int32_t key) -> py::object {
+           const auto index = model.find_index(key);
+           if (index == SWCModel::invalid_index) {
+             return py::none();
+           }
+           return py::int_(index);
+         })
+    .def("get_node",
+         [](const SWCModel& model, const size_t index) -> SWCNode {
+           if (index >= model.num_nodes()) {
+             throw py::index_error();
+           }
+           return model.get_node(index);
+         })
+    .def("parent_index",
+         [](const SWCModel& model, const size_t index) -> py::object {
+           if (index >= model.num_nodes()) {
+             throw py::index_error();
+           }
+           const auto parent = model.parent_index(index);
+           if (parent == SWCModel::invalid_index) {
+             return py::none();
+           }
+           return py::int_(parent);
+         })
+    .def("children",
+         [](const SWCModel& model, const size_t index) -> std::vector<uint32_t> {
+           if (index >= model.num_nodes()) {
+             throw py::index_error();
+           }
+           const auto* children = model.children(index);
+           return std::vector<uint32_t>(children, children + model.num_children(index));
+         })
+    .def("preorder",
+         [](const SWCModel& model) -> std::vector<uint32_t> {
+           return std::vector<uint32_t>(model.preorder(), model.preorder() + model.preorder_size());
+         })
+    .def("branch_points",
+         [](const SWCModel& model) -> std::vector<uint32_t> {
+           std::vector<uint32_t> result;
+           for (size_t i = 0; i < model.num_nodes(); i++) {
+             if (model.is_branch_point(i)) {
+               result.emplace_back(static_cast<uint32_t>(i));
+             }
+           }
+           return result;
+         })
+    .def("tips",
+         [](const SWCModel& model) -> std::vector<uint32_t> {
+           std::vector<uint32_t> result;
+           for (size_t i = 0; i < model.num_nodes(); i++) {
+             if (model.is_tip(i)) {
+               result.emplace_back(static_cast<uint32_t>(i));
+             }
+           }
+           return result;
+         })
+    .def("branch_orders",
+         [](const SWCModel& model) -> std::vector<uint32_t> {
+           std::vector<uint32_t> result(model.num_nodes());
+           model.compute_branch_orders(result.data());
+           return result;
+         })
+    .def("path_distances",
+         [](const SWCModel& model) -> std::vector<float> {
+           std::vector<float> result(model.num_nodes());
+           model.compute_path_distances(result.data());
+           return result;
+         })
+    .def("subtree_sizes",
+         [](const SWCModel& model) -> std::vector<uint32_t> {
+           std::vector<uint32_t> result(model.num_nodes());
+           model.compute_subtree_sizes(result.data());
+           return result;
+         })
+    .def("share_geometry", &SWCModel::share_geometry)
+    .def("has_shared_geometry", &SWCModel::has_shared_geometry)
+    .def(
+      "arrays",
+      [](const py::object& self) -> py::dict {
+        const auto& model = self.cast<const SWCModel&>();
+        const auto n = model.num_nodes();
+        // The coordinate columns are equally spaced, so they can be presented as one (n, 3) array.
+        const auto column_stride =
+          reinterpret_cast<const uint8_t*>(model.y()) - reinterpret_cast<const uint8_t*>(model.x());
+        // The views point into the columns, so the model refuses to load anything else while any of them exist.
+        const auto owner = pin_model(self);
+        py::dict result;
+        result["ids"] = column_view(model.ids(), n, owner);
+        result["types"] = column_view(reinterpret_cast<const uint8_t*>(model.types()), n, owner);
+        result["positions"] = read_only_view(py::dtype::of<float>(),
+                                             { static_cast<py::ssize_t>(n), 3 },
+                                             { static_cast<py::ssize_t>(sizeof(float)), column_stride },
+                                             model.x(),
+                                             owner);
+        result["radii"] = column_view(model.radii(), n, owner);
+        result["parents"] = column_view(model.parents(), n, owner);
+        result["parent_indices"] = column_view(model.parent_indices(), n, owner);
+        return result;
+      })
+    .def(
+      "nodes",
+      [](const SWCModel& model) -> py::array {
+        py::list names;
+        names.append("id");
+        names.append("type");
+        names.append("position");
+        names.append("radius");
+        names.append("parent");
+        py::list formats;
+        formats.append("<i4");
+        formats.append("u1");
+        formats.append("(3,)<f4");
+        formats.append("<f4");
+        formats.append("<i4");
+        py::list offsets;
+        offsets.append(offsetof(SWCNode, id));
+        offsets.append(offsetof(SWCNode, type));
+        offsets.append(offsetof(SWCNode, position));
+        offsets.append(offsetof(SWCNode, radius));
+        offsets.append(offsetof(SWCNode, parent));
+        const py::dtype dtype(names, formats, offsets, sizeof(SWCNode));
+        py::array result(dtype, { static_cast<py::ssize_t>(model.num_nodes()) });
+        auto* records = static_cast<SWCNode*>(result.mutable_data());
+        for (size_t i = 0; i < model.num_nodes(); i++) {
+          records[i] = model.get_node(i);
+        }
+        return result;
+      })
+    .def(
+      "find_indices",
+      [](const SWCModel& model, const py::array_t<int32_t, py::array::c_style | py::array::forcecast>& ids) {
+        py::array_t<int64_t> result(ids.size());
+        const auto* keys = ids.data();
+        auto* indices = result.mutable_data();
+        {
+          py::gil_scoped_release release;
+          for (py::ssize_t i = 0; i < ids.size(); i++) {
+            const auto index = model.find_index(keys[i]);
+            indices[i] = (index == SWCModel::invalid_index) ? -1 : static_cast<int64_t>(index);
+          }
+        }
+        return result;
+      },
+      py::arg("ids"));
+
+  m.def("load_many", &load_all, py::arg("paths"));
+
+  m.def(
+    "load_directory",
+    [](const std::string& path, const std::string& extension) -> py::tuple {
+      std::vector<std::string> paths;
+      for (const auto& entry : std::filesystem::directory_iterator(path)) {
+        if (entry.is_regular_file() && (entry.path().extension() == extension)) {
+          paths.emplace_back(entry.path().string());
+        }
+      }
+      std::sort(paths.begin(), paths.end());
+      auto result = load_all(paths);
+      return py::make_tuple(paths, result[0], result[1]);
+    },
+    py::arg("path"),
+    py::arg("extension") = ".swc");
+
+  m.def("convert_swc_to_binary", &convert_swc_to_binary, py::arg("swc_path"), py::arg("binary_path"));
+
+  py::class_<LODConfig>(m, "LODConfig")
+    .def(py::init<>())
+    .def_readwrite("enabled", &LODConfig::enabled)
+    .def_readwrite("collinear_tolerance", &LODConfig::collinear_tolerance)
+    .def_readwrite("min_twig_length", &LODConfig::min_twig_length)
+    .def_readwrite("max_segment_length", &LODConfig::max_segment_length);
+
+  m.def(
+    "simplify_model",
+    [](const SWCModel& model, const float pixel_size, const LODConfig& config) -> std::unique_ptr<SWCModel> {
+      auto result = std::make_unique<SWCModel>();
+      bool ok = false;
+      {
+        py::gil_scoped_release release;
+        ok = simplify_model(model, pixel_size, config, result.get());
       }
+      if (!ok) {
+        throw std::bad_alloc();
+      }
+      return result;
+    },
+    py::arg("model"),
+    py::arg("pixel_size"),
+    py::arg("config") = LODConfig{});
+
+  py::enum_<RTCBuildQuality>(m, "BuildQuality")
+    .value("LOW", RTC_BUILD_QUALITY_LOW)
+    .value("MEDIUM", RTC_BUILD_QUALITY_MEDIUM)
+    .value("HIGH", RTC_BUILD_QUALITY_HIGH)
+    .value("REFIT", RTC_BUILD_QUALITY_REFIT);
+
+  py::enum_<NeuriteCurve>(m, "NeuriteCurve")
+    .value("LINEAR", NeuriteCurve::LINEAR)
+    .value("CATMULL_ROM", NeuriteCurve::CATMULL_ROM)
+    .value("BSPLINE", NeuriteCurve::BSPLINE);
+
+  py::class_<SceneConfig>(m, "SceneConfig")
+    .def(py::init<>())
+    .def_readwrite("build_quality", &SceneConfig::build_quality)
+    .def_readwrite("instance_build_quality", &SceneConfig::instance_build_quality)
+    .def_readwrite("compact", &SceneConfig::compact)
+    .def_readwrite("robust", &SceneConfig::robust)
+    .def_readwrite("dynamic", &SceneConfig::dynamic)
+    .def_readwrite("clip_to_view", &SceneConfig::clip_to_view)
+    .def_readwrite("clip_margin", &SceneConfig::clip_margin)
+    .def_readwrite("neurite_curve", &SceneConfig::neurite_curve)
+    .def_readwrite("curve_stride", &SceneConfig::curve_stride)
+    .def_readwrite("occupancy_grid_size", &SceneConfig::occupancy_grid_size);
+
+  py::class_<ClipRect>(m, "ClipRect")
+    .def(py::init<>())
+    .def(py::init([](const float lower_x, const float lower_y, const float upper_x, const float upper_y) {
+           return ClipRect{ lower_x, lower_y, upper_x, upper_y };
+         }),
+         py::arg("lower_x"),
+         py::arg("lower_y"),
+         py::arg("upper_x"),
+         py::arg("upper_y"))
+    .def_readwrite("lower_x", &ClipRect::lower_x)
+    .def_readwrite("lower_y", &ClipRect::lower_y)
+    .def_readwrite("upper_x", &ClipRect::upper_x)
+    .def_readwrite("upper_y", &ClipRect::upper_y);
+
+  py::class_<Scene>(m, "Scene")
+    .def(py::init([]() { return std::make_unique<Scene>(default_device()); }))
+    .def(py::init([](const SWCModel& model, const Transform& transform) {
+           auto scene = std::make_unique<Scene>(default_device());
+           if (!scene->from_swc_model(model, transform)) {
+             throw std::bad_alloc();
+           }
+           return scene;
+         }),
+         py::arg("model"),
+         py::arg("transform") = Transform{})
+    .def("from_swc_model",
+         &Scene::from_swc_model,
+         py::arg("model"),
+         py::arg("transform") = Transform{})
+    .def(
+      "add_neuron",
+      [](Scene& self, const SWCModel& model, const Transform& transform) -> unsigned int {
+        const auto instance_id = self.add_neuron(model, transform);
+        if (instance_id == RTC_INVALID_GEOMETRY_ID) {
+          throw std::bad_alloc();
+        }
+        return instance_id;
+      },
+      py::arg("model"),
+      py::arg("transform") = Transform{})
+    .def(
+      "set_transform",
+      [](Scene& self, const Transform& transform, const unsigned int instance_id, const bool commit) {
+        if (!self.set_transform(instance_id, transform)) {
+          throw py::index_error();
+        }
+        if (commit) {
+          self.commit();
+        }
+      },
+      py::arg("transform"),
+      py::arg("instance_id") = 0,
+      py::arg("commit") = true)
+    .def("set_config", &Scene::set_config, py::arg("config"))
+    .def("set_clip_rect", &Scene::set_clip_rect, py::arg("clip"))
+    .def("clear_clip_rect", &Scene::clear_clip_rect)
+    .def("may_overlap", &Scene::may_overlap, py::arg("rect"))
+    .def("commit", &Scene::commit)
+    .def("clear", &Scene::clear)
+    .def("num_neurons", &Scene::num_neurons)
+    .def("num_prototypes", &Scene::num_prototypes)
+    .def("packet_size", &Scene::packet_size)
+    .def(
+      "intersect",
+      [](const Scene& self, const Vec3f& origin, const Vec3f& direction) -> py::object {
+        const auto isect = self.intersect1(origin, direction);
+        if (isect.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+          return py::none();
+        }
+        py::dict result;
+        result["instance_id"] = isect.hit.instID[0];
+        result["neurite"] = self.is_neurite(isect.hit.geomID);
+        result["primitive_id"] = isect.hit.primID;
+        result["distance"] = isect.ray.tfar;
+        return result;
+      },
+      py::arg("origin"),
+      py::arg("direction") = Vec3f{ 0, 0, -1 })
+    .def("bounds", [](const Scene& self) -> py::tuple {
+      const auto bounds = self.get_bounds();
+      return py::make_tuple(py::make_tuple(bounds.lower_x, bounds.lower_y, bounds.lower_z),
+                            py::make_tuple(bounds.upper_x, bounds.upper_y, bounds.upper_z));
+    })
+    .def("unclipped_bounds", [](const Scene& self) -> py::tuple {
+      const auto bounds = self.unclipped_bounds();
+      return py::make_tuple(py::make_tuple(bounds.lower_x, bounds.lower_y, bounds.lower_z),
+                            py::make_tuple(bounds.upper_x, bounds.upper_y, bounds.upper_z));
     });
 
   py::class_<Microscope>(m, "Microscope")
-    .def("capture", &Microscope::capture, py::arg("model"), py::arg("tissue"), py::arg("transform") = Transform{});
+    .def("capture",
+         py::overload_cast<const SWCModel&, const Tissue&, const Transform&>(&Microscope::capture),
+         py::arg("model"),
+         py::arg("tissue"),
+         py::arg("transform") = Transform{})
+    .def("capture",
+         py::overload_cast<const Scene&, const Tissue&>(&Microscope::capture),
+         py::arg("scene"),
+         py::arg("tissue"));
+
+  py::class_<TileConfig>(m, "TileConfig")
+    .def(py::init<>())
+    .def_readwrite("tile_size", &TileConfig::tile_size)
+    .def_readwrite("record_timings", &TileConfig::record_timings);
+
+  py::class_<MicroscopeBase, Microscope>(m, "MicroscopeBase")
+    .def("set_scene_config", &MicroscopeBase::set_scene_config, py::arg("config"))
+    .def("set_lod_config", &MicroscopeBase::set_lod_config, py::arg("config"))
+    .def("set_tile_config", &MicroscopeBase::set_tile_config, py::arg("config"))
+    .def("tile_timings",
+         [](const MicroscopeBase& self) -> py::dict {
+           // One array per field, one entry per tile in the order they were handed out.
+           Array<CaptureTile> tiles;
+           if (!self.copy_tiles(&tiles)) {
+             throw std::bad_alloc();
+           }
+           const auto n = static_cast<py::ssize_t>(tiles.size());
+           py::array_t<uint32_t> x(n), y(n), width(n), height(n);
+           py::array_t<float> seconds(n);
+           py::array_t<int> thread(n);
+           for (py::ssize_t i = 0; i < n; i++) {
+             x.mutable_at(i) = tiles[i].x;
+             y.mutable_at(i) = tiles[i].y;
+             width.mutable_at(i) = tiles[i].width;
+             height.mutable_at(i) = tiles[i].height;
+             seconds.mutable_at(i) = tiles[i].seconds;
+             thread.mutable_at(i) = tiles[i].thread;
+           }
+           py::dict result;
+           result["x"] = x;
+           result["y"] = y;
+           result["width"] = width;
+           result["height"] = height;
+           result["seconds"] = seconds;
+           result["thread"] = thread;
+           return result;
+         });
+
+  py::enum_<SegmentationBackend>(m, "SegmentationBackend")
+    .value("RAY_TRACING", SegmentationBackend::RAY_TRACING)
+    .value("RASTERIZATION", SegmentationBackend::RASTERIZATION);
+
+  py::class_<SegmentationConfig>(m, "SegmentationConfig")
+    .def(py::init<>())
+    .def_readwrite("backend", &SegmentationConfig::backend)
+    .def_readwrite("adaptive", &SegmentationConfig::adaptive)
+    .def_readwrite("refine_distance", &SegmentationConfig::refine_distance);
 
-  py::class_<SegmentationMicroscope, Microscope>(m, "SegmentationMicroscope")
+  py::class_<SegmentationMicroscope, MicroscopeBase>(m, "SegmentationMicroscope")
     .def(py::init<size_t, size_t, float>(),
          py::arg("image_width") = 640,
          py::arg("image_height") = 480,
@@ -69,6 +569,7 @@ PYBIND11_MODULE(neuroscope, m)
            const auto& sensor = self.get_sensor();
            return py::make_tuple(sensor.width(), sensor.height());
          })
+    .def("set_config", &SegmentationMicroscope::set_config, py::arg("config"))
     .def("copy_rgb_buffer", [](const SegmentationMicroscope& self) -> py::bytes {
       auto& sensor = self.get_sensor();
       auto* data = sensor.get_array_data();
@@ -82,7 +583,7 @@ PYBIND11_MODULE(neuroscope, m)
     .def_readwrite("min_emission", &FluorescenceConfig::min_emission)
     .def_readwrite("max_emission", &FluorescenceConfig::max_emission);
 
-  py::class_<FluorescenceMicroscope, Microscope>(m, "FluorescenceMicroscope")
+  py::class_<FluorescenceMicroscope, MicroscopeBase>(m, "FluorescenceMicroscope")
     .def(py::init<size_t, size_t, float>(),
          py::arg("image_width") = 640,
          py::arg("image_height") = 480,
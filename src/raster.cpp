@@ -0,0 +1,414 @@
+#include "raster.h"
+
+#include "core.h"
+#include "random.h"
+#include "scene.h"
+
+#include <math.h>
+#include <sys/types.h>
+
+namespace {
+
+/**
+ * @brief The number of samples per pixel, which has to match the ray traced segmentation.
+ * */
+constexpr int samples_per_pixel{ 16 };
+
+/**
+ * @brief A round linear segment in world space, with the radius of each end point in the fourth component.
+ *        A sphere is a segment whose end points are the same.
+ * */
+struct Capsule final
+{
+  Vec4f a;
+
+  Vec4f b;
+
+  bool soma;
+};
+
+[[nodiscard]] auto
+transform_vertex(const float* m, const Vec4f& v) -> Vec4f
+{
+  return Vec4f{ m[0] * v[0] + m[1] * v[1] + m[2] * v[2] + m[3],
+                m[4] * v[0] + m[5] * v[1] + m[6] * v[2] + m[7],
+                m[8] * v[0] + m[9] * v[1] + m[10] * v[2] + m[11],
+                v[3] };
+}
+
+[[nodiscard]] auto
+append_capsule(Array<Capsule>& capsules, const Vec4f& a, const Vec4f& b, const bool soma) -> bool
+{
+  auto* capsule = capsules.append();
+  if (!capsule) {
+    return false;
+  }
+  *capsule = Capsule{ a, b, soma };
+  return true;
+}
+
+[[nodiscard]] auto
+append_segments(Array<Capsule>& capsules, const CurveBuffers& buffers, const float* m, const bool soma) -> bool
+{
+  for (size_t i = 0; i < buffers.num_primitives; i++) {
+    const auto* p = buffers.vertices + buffers.indices[i];
+    if (!append_capsule(capsules, transform_vertex(m, p[0]), transform_vertex(m, p[1]), soma)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Whether every neuron in the scene has linear neurites, which are the only primitives rendered here.
+ * */
+[[nodiscard]] auto
+has_linear_neurites(const Scene& scene) -> bool
+{
+  for (size_t i = 0; i < scene.num_neurons(); i++) {
+    if (scene.neuron_geometry(static_cast<unsigned int>(i)).neurite_curve() != NeuriteCurve::LINEAR) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Gathers the primitives of every neuron in the scene, placed in world space.
+ * */
+[[nodiscard]] auto
+collect_capsules(const Scene& scene, Array<Capsule>& capsules) -> bool
+{
+  for (size_t i = 0; i < scene.num_neurons(); i++) {
+
+    const auto instance_id = static_cast<unsigned int>(i);
+
+    const auto& geometry = scene.neuron_geometry(instance_id);
+
+    float m[12];
+    scene.neuron_transform(instance_id).to_matrix(m);
+
+    if (const auto* sphere = geometry.soma_sphere()) {
+      const auto center = transform_vertex(m, *sphere);
+      if (!append_capsule(capsules, center, center, true)) {
+        return false;
+      }
+    }
+
+    if (!append_segments(capsules, geometry.soma_segments(), m, true) ||
+        !append_segments(capsules, geometry.neurites(), m, false)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief The signed distance from a point to the projection of a capsule onto the XY plane, which is the convex hull
+ *        of its two end discs.
+ *
+ * @details This is the uneven capsule distance by Inigo Quilez, with the case of one disc containing the other
+ *          handled separately.
+ * */
+[[nodiscard]] auto
+projected_distance(const float px, const float py, const Capsule& c) -> float
+{
+  const auto ra = c.a[3];
+  const auto rb = c.b[3];
+
+  const auto x = px - c.a[0];
+  const auto y = py - c.a[1];
+
+  const auto bx = c.b[0] - c.a[0];
+  const auto by = c.b[1] - c.a[1];
+
+  const auto h = bx * bx + by * by;
+
+  const auto b = ra - rb;
+
+  if (h <= b * b) {
+    // One disc contains the other, so the shape is just the larger disc.
+    return (ra >= rb) ? (sqrtf(x * x + y * y) - ra) : (sqrtf((x - bx) * (x - bx) + (y - by) * (y - by)) - rb);
+  }
+
+  const auto qx = fabsf(x * by - y * bx) / h;
+  const auto qy = (x * bx + y * by) / h;
+
+  const auto cx = sqrtf(h - b * b);
+  const auto cy = b;
+
+  const auto k = cx * qy - cy * qx;
+  const auto m = cx * qx + cy * qy;
+  const auto n = qx * qx + qy * qy;
+
+  if (k < 0.0F) {
+    return sqrtf(h * n) - ra;
+  }
+
+  if (k > cx) {
+    return sqrtf(h * (n + 1.0F - 2.0F * qy)) - rb;
+  }
+
+  return m - ra;
+}
+
+/**
+ * @brief The height at which a ray going straight down through a point first hits a sphere.
+ *
+ * @return Negative infinity if the ray misses it.
+ * */
+[[nodiscard]] auto
+sphere_height(const float px, const float py, const Vec4f& s) -> float
+{
+  const auto dx = px - s[0];
+  const auto dy = py - s[1];
+  const auto h = s[3] * s[3] - dx * dx - dy * dy;
+  return (h >= 0.0F) ? (s[2] + sqrtf(h)) : -static_cast<float>(INFINITY);
+}
+
+/**
+ * @brief The height at which a ray going straight down through a point first hits a capsule, which is exactly where
+ *        it hits the round linear curve that Embree traces.
+ *
+ * @details The capsule is the convex hull of its two end spheres, a cone with spherical caps. This is the rounded
+ *          cone intersection by Inigo Quilez, with the ray direction fixed to negative Z. The ray starts above the
+ *          capsule, so the distances along it stay small.
+ *
+ * @return Negative infinity if the ray misses it.
+ * */
+[[nodiscard]] auto
+surface_height(const float px, const float py, const Capsule& c) -> float
+{
+  const auto ra = c.a[3];
+  const auto rb = c.b[3];
+
+  const Vec3f ba{ c.b[0] - c.a[0], c.b[1] - c.a[1], c.b[2] - c.a[2] };
+
+  const auto rr = ra - rb;
+  const auto m0 = ba[0] * ba[0] + ba[1] * ba[1] + ba[2] * ba[2];
+  const auto d2 = m0 - rr * rr;
+
+  // One sphere contains the other (or the capsule is a sphere), so the shape is just the larger sphere.
+  if (d2 <= 0.0F) {
+    return (ra >= rb) ? sphere_height(px, py, c.a) : sphere_height(px, py, c.b);
+  }
+
+  const auto top_a = c.a[2] + ra;
+  const auto top_b = c.b[2] + rb;
+  const auto oz = ((top_a > top_b) ? top_a : top_b) + 1.0F;
+
+  const Vec3f oa{ px - c.a[0], py - c.a[1], oz - c.a[2] };
+
+  // The dot products with the direction (0, 0, -1) are just negated Z components.
+  const auto m1 = ba[0] * oa[0] + ba[1] * oa[1] + ba[2] * oa[2];
+  const auto m2 = -ba[2];
+  const auto m3 = -oa[2];
+  const auto m5 = oa[0] * oa[0] + oa[1] * oa[1] + oa[2] * oa[2];
+
+  // The cone between the caps.
+  const auto k2 = d2 - m2 * m2;
+  const auto k1 = d2 * m3 - m1 * m2 + m2 * rr * ra;
+  const auto k0 = d2 * m5 - m1 * m1 + m1 * rr * ra * 2.0F - m0 * ra * ra;
+
+  const auto h = k1 * k1 - k0 * k2;
+
+  if ((h >= 0.0F) && (k2 != 0.0F)) {
+    const auto t = (-sqrtf(h) - k1) / k2;
+    const auto y = m1 - ra * rr + t * m2;
+    if ((y > 0.0F) && (y < d2)) {
+      return oz - t;
+    }
+  }
+
+  // Otherwise the ray first hits one of the caps, if anything.
+  const auto height_a = sphere_height(px, py, c.a);
+  const auto height_b = sphere_height(px, py, c.b);
+
+  return (height_a > height_b) ? height_a : height_b;
+}
+
+} // namespace
+
+auto
+rasterize_segmentation(const Scene& scene,
+                       const float vertical_fov,
+                       const size_t width,
+                       const size_t height,
+                       const size_t tile_size,
+                       uint8_t* pixels) -> bool
+{
+  const auto x_scale{ 1.0F / static_cast<float>(width) };
+  const auto y_scale{ 1.0F / static_cast<float>(height) };
+  const auto aspect{ static_cast<float>(width) / static_cast<float>(height) };
+  const auto fov{ vertical_fov * 0.5F };
+
+  const size_t tile = (tile_size > 0) ? tile_size : 1;
+  const auto tiles_x = (width + tile - 1) / tile;
+  const auto tiles_y = (height + tile - 1) / tile;
+  const auto num_tiles = tiles_x * tiles_y;
+
+  Array<Capsule> capsules;
+
+  if (!has_linear_neurites(scene) || !collect_capsules(scene, capsules)) {
+    return false;
+  }
+
+  /* The capsules are sorted into the tiles their bounds overlap, by counting them per tile, turning the counts into
+   * offsets and then filling in the lists.
+   */
+
+  Array<uint32_t> tile_offsets;
+
+  Array<uint32_t> tile_capsules;
+
+  if (!tile_offsets.resize(num_tiles + 1)) {
+    return false;
+  }
+
+  for (size_t i = 0; i <= num_tiles; i++) {
+    tile_offsets[i] = 0;
+  }
+
+  // Gets the range of tiles overlapped by a capsule, returning false if it is out of view.
+  const auto tile_range = [&](const Capsule& c, size_t* x0, size_t* y0, size_t* x1, size_t* y1) -> bool {
+    const auto r = (c.a[3] > c.b[3]) ? c.a[3] : c.b[3];
+    const auto lower_x = (((c.a[0] < c.b[0]) ? c.a[0] : c.b[0]) - r) / (fov * aspect);
+    const auto upper_x = (((c.a[0] > c.b[0]) ? c.a[0] : c.b[0]) + r) / (fov * aspect);
+    const auto lower_y = (((c.a[1] < c.b[1]) ? c.a[1] : c.b[1]) - r) / fov;
+    const auto upper_y = (((c.a[1] > c.b[1]) ? c.a[1] : c.b[1]) + r) / fov;
+    if ((upper_x < -1.0F) || (lower_x > 1.0F) || (upper_y < -1.0F) || (lower_y > 1.0F)) {
+      return false;
+    }
+    const auto to_tile = [tile](const float v, const size_t size, const size_t num) -> size_t {
+      const auto pixel = clamp((v + 1.0F) * 0.5F * static_cast<float>(size), 0.0F, static_cast<float>(size - 1));
+      const auto index = static_cast<size_t>(pixel) / tile;
+      return (index < num) ? index : (num - 1);
+    };
+    *x0 = to_tile(lower_x, width, tiles_x);
+    *x1 = to_tile(upper_x, width, tiles_x);
+    *y0 = to_tile(lower_y, height, tiles_y);
+    *y1 = to_tile(upper_y, height, tiles_y);
+    return true;
+  };
+
+  for (size_t i = 0; i < capsules.size(); i++) {
+    size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    if (!tile_range(capsules[i], &x0, &y0, &x1, &y1)) {
+      continue;
+    }
+    for (auto ty = y0; ty <= y1; ty++) {
+      for (auto tx = x0; tx <= x1; tx++) {
+        tile_offsets[ty * tiles_x + tx + 1]++;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_tiles; i++) {
+    tile_offsets[i + 1] += tile_offsets[i];
+  }
+
+  if (!tile_capsules.resize(tile_offsets[num_tiles])) {
+    return false;
+  }
+
+  {
+    Array<uint32_t> cursors;
+
+    if (!cursors.resize(num_tiles)) {
+      return false;
+    }
+
+    for (size_t i = 0; i < num_tiles; i++) {
+      cursors[i] = tile_offsets[i];
+    }
+
+    for (size_t i = 0; i < capsules.size(); i++) {
+      size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+      if (!tile_range(capsules[i], &x0, &y0, &x1, &y1)) {
+        continue;
+      }
+      for (auto ty = y0; ty <= y1; ty++) {
+        for (auto tx = x0; tx <= x1; tx++) {
+          tile_capsules[cursors[ty * tiles_x + tx]++] = static_cast<uint32_t>(i);
+        }
+      }
+    }
+  }
+
+  // Tiles differ a lot in how many capsules they hold, so they are handed out one at a time.
+#pragma omp parallel for schedule(dynamic)
+
+  for (ssize_t t = 0; t < static_cast<ssize_t>(num_tiles); t++) {
+
+    const auto tx = static_cast<size_t>(t) % tiles_x;
+    const auto ty = static_cast<size_t>(t) / tiles_x;
+
+    const auto* list = tile_capsules.data() + tile_offsets[t];
+
+    const auto list_size = tile_offsets[t + 1] - tile_offsets[t];
+
+    const auto x_end = ((tx + 1) * tile < width) ? ((tx + 1) * tile) : width;
+    const auto y_end = ((ty + 1) * tile < height) ? ((ty + 1) * tile) : height;
+
+    for (auto y = ty * tile; y < y_end; y++) {
+
+      for (auto x = tx * tile; x < x_end; x++) {
+
+        int r{ 0 };
+        int g{ 0 };
+        int b{ 255 };
+
+        Random rng(y * width + x);
+
+        for (int i = 0; (i < samples_per_pixel) && (list_size > 0); i++) {
+
+          const auto u = (static_cast<float>(x) + rng.next_float()) * x_scale;
+          const auto v = (static_cast<float>(y) + rng.next_float()) * y_scale;
+
+          const auto px = (u * 2.0F - 1.0F) * fov * aspect;
+          const auto py = (v * 2.0F - 1.0F) * fov;
+
+          const Capsule* top = nullptr;
+
+          float top_height{ 0.0F };
+
+          for (size_t j = 0; j < list_size; j++) {
+            const auto& capsule = capsules[list[j]];
+            if (projected_distance(px, py, capsule) > 0.0F) {
+              continue;
+            }
+            // Rounding can make a ray that grazes the outline miss, in which case it does not count as covered.
+            const auto z = surface_height(px, py, capsule);
+            if (isinf(z)) {
+              continue;
+            }
+            if (!top || (z > top_height)) {
+              top = &capsule;
+              top_height = z;
+            }
+          }
+
+          if (top) {
+            b = 0;
+            if (top->soma) {
+              r = 255;
+            } else {
+              g = 255;
+            }
+            break;
+          }
+        }
+
+        auto* pixel = pixels + (y * width + x) * 3;
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+      }
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file raster.h
+ *
+ * @brief Renders scenes without ray tracing, by projecting their primitives onto the image plane.
+ * */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Scene;
+
+/**
+ * @brief Renders the segmentation labels of a scene by testing the same jittered samples as the ray traced
+ *        segmentation against the projected primitives.
+ *
+ * @details The microscopes look straight down the Z axis with an orthographic projection, so the footprint of a
+ *          round linear segment on the image is the 2D shape swept by its end discs, which has a closed form
+ *          distance function. The primitives are taken from the scene in world space and sorted into square tiles
+ *          of pixels, and the tiles are rendered concurrently.
+ *
+ *          Each pixel is labeled by the first of its samples that is covered, as in the ray traced path. Where a soma
+ *          and a neurite overlap, the label is that of the one whose surface is higher up at the sample, which is
+ *          computed exactly, so it is the primitive a ray would hit first.
+ *
+ *          Spline neurites are not rendered here, since Embree intersects them numerically and a closed form would not
+ *          give the same labels. Scenes with spline neurites are left to the ray tracer.
+ *
+ * @param scene The scene to render. It needs to be committed.
+ * @param vertical_fov The height of the view, in world units.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param tile_size The width and height of a tile, in pixels.
+ * @param pixels Receives the RGB labels.
+ *
+ * @return False if the scene has spline neurites, or if the tile lists could not be allocated.
+ * */
+[[nodiscard]] auto
+rasterize_segmentation(const Scene& scene,
+                       float vertical_fov,
+                       size_t width,
+                       size_t height,
+                       size_t tile_size,
+                       uint8_t* pixels) -> bool;
@@ -2,62 +2,389 @@
 
 #include "swc.h"
 
-Scene::Scene(RTCDevice device)
-  : scene_(rtcNewScene(device))
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+
+auto
+default_device() -> RTCDevice
+{
+  // Created on first use and kept for the lifetime of the process.
+  static const RTCDevice device = rtcNewDevice("");
+  return device;
+}
+
+auto
+native_ray_packet_size(RTCDevice device) -> size_t
+{
+  if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED)) {
+    return 16;
+  }
+  if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED)) {
+    return 8;
+  }
+  return 4;
+}
+
+namespace {
+
+/**
+ * @brief The node count from which the soma nodes are counted concurrently. The neurites have their own threshold.
+ * */
+constexpr size_t parallel_build_threshold{ 64 * 1024 };
+
+/**
+ * @brief Marks an empty slot of the prototype index.
+ * */
+constexpr uint32_t invalid_prototype{ 0xffffffffu };
+
+[[nodiscard]] auto
+hash_generation(const uint64_t generation) -> size_t
+{
+  // Fibonacci hashing spreads consecutive generations over the table.
+  return static_cast<size_t>((generation * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/**
+ * @brief Whether a segment overlaps a rectangle once it is placed with a row major 3x4 matrix.
+ *
+ * @details The bounds of the segment are those of its end points, grown by the larger of the two radii.
+ * */
+[[nodiscard]] auto
+overlaps(const Vec4f& a, const Vec4f& b, const float* m, const ClipRect& clip) -> bool
+{
+  const auto ax = m[0] * a[0] + m[1] * a[1] + m[2] * a[2] + m[3];
+  const auto ay = m[4] * a[0] + m[5] * a[1] + m[6] * a[2] + m[7];
+  const auto bx = m[0] * b[0] + m[1] * b[1] + m[2] * b[2] + m[3];
+  const auto by = m[4] * b[0] + m[5] * b[1] + m[6] * b[2] + m[7];
+  const auto r = (a[3] > b[3]) ? a[3] : b[3];
+  return (((ax < bx) ? ax : bx) - r <= clip.upper_x) && (((ax > bx) ? ax : bx) + r >= clip.lower_x) &&
+         (((ay < by) ? ay : by) - r <= clip.upper_y) && (((ay > by) ? ay : by) + r >= clip.lower_y);
+}
+
+/**
+ * @brief The number of consecutive primitives covered by each box of a footprint. Consecutive segments are usually
+ *        adjacent, so short runs stay tight while cutting the work of placing a footprint by about this factor.
+ * */
+constexpr size_t footprint_run{ 8 };
+
+/**
+ * @brief The longest unbranched run, in edges, that is kept as round linear segments rather than fit with a B-spline.
+ *        With its end points repeated, a B-spline over a run this short has at least as many curves as edges.
+ * */
+constexpr size_t max_linear_run_edges{ 4 };
+
+/**
+ * @brief Grows a box to cover a curve primitive, given its control points and how far it may leave their hull.
+ * */
+void
+grow_bounds(RTCBounds* bounds, const Vec4f* points, const size_t count, const float growth)
+{
+  float lower[3]{ static_cast<float>(INFINITY), static_cast<float>(INFINITY), static_cast<float>(INFINITY) };
+  float upper[3]{ -static_cast<float>(INFINITY), -static_cast<float>(INFINITY), -static_cast<float>(INFINITY) };
+  float radius = 0.0F;
+
+  for (size_t i = 0; i < count; i++) {
+    for (size_t k = 0; k < 3; k++) {
+      lower[k] = (points[i][k] < lower[k]) ? points[i][k] : lower[k];
+      upper[k] = (points[i][k] > upper[k]) ? points[i][k] : upper[k];
+    }
+    radius = (points[i][3] > radius) ? points[i][3] : radius;
+  }
+
+  // The radius is interpolated like the position, so it overshoots by the same fraction.
+  radius *= 1.0F + growth;
+
+  for (size_t k = 0; k < 3; k++) {
+    const auto grow = (upper[k] - lower[k]) * growth + radius;
+    lower[k] -= grow;
+    upper[k] += grow;
+  }
+
+  bounds->lower_x = (lower[0] < bounds->lower_x) ? lower[0] : bounds->lower_x;
+  bounds->lower_y = (lower[1] < bounds->lower_y) ? lower[1] : bounds->lower_y;
+  bounds->lower_z = (lower[2] < bounds->lower_z) ? lower[2] : bounds->lower_z;
+  bounds->upper_x = (upper[0] > bounds->upper_x) ? upper[0] : bounds->upper_x;
+  bounds->upper_y = (upper[1] > bounds->upper_y) ? upper[1] : bounds->upper_y;
+  bounds->upper_z = (upper[2] > bounds->upper_z) ? upper[2] : bounds->upper_z;
+}
+
+[[nodiscard]] auto
+empty_bounds() -> RTCBounds
+{
+  RTCBounds bounds{};
+  bounds.lower_x = bounds.lower_y = bounds.lower_z = static_cast<float>(INFINITY);
+  bounds.upper_x = bounds.upper_y = bounds.upper_z = -static_cast<float>(INFINITY);
+  return bounds;
+}
+
+/**
+ * @brief A neurite layout written to scratch space by @ref write_layout.
+ * */
+struct NeuriteLayout final
+{
+  Array<Vec4f> vertices;
+
+  Array<uint32_t> indices;
+
+  Array<uint8_t> types;
+};
+
+[[nodiscard]] auto
+write_layout(const SWCModel& model, NeuriteLayout* layout) -> bool
+{
+  size_t num_segments = 0;
+
+  size_t num_vertices = 0;
+
+  model.count_neurite_geometry(&num_segments, &num_vertices);
+
+  return layout->vertices.resize(num_vertices) && layout->indices.resize(num_segments) &&
+         layout->types.resize(num_segments) &&
+         model.write_neurite_geometry(layout->vertices.data(), layout->indices.data(), layout->types.data());
+}
+
+[[nodiscard]] auto
+neurite_geometry_type(const NeuriteCurve curve) -> RTCGeometryType
+{
+  switch (curve) {
+    case NeuriteCurve::LINEAR:
+      break;
+    case NeuriteCurve::CATMULL_ROM:
+      return RTC_GEOMETRY_TYPE_ROUND_CATMULL_ROM_CURVE;
+    case NeuriteCurve::BSPLINE:
+      return RTC_GEOMETRY_TYPE_ROUND_BSPLINE_CURVE;
+  }
+  return RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE;
+}
+
+[[nodiscard]] auto
+scene_build_quality(const RTCBuildQuality quality) -> RTCBuildQuality
+{
+  return (quality == RTC_BUILD_QUALITY_REFIT) ? RTC_BUILD_QUALITY_LOW : quality;
+}
+
+[[nodiscard]] auto
+scene_flags(const SceneConfig& config, const bool top_level) -> RTCSceneFlags
+{
+  int flags = RTC_SCENE_FLAG_NONE;
+  flags |= config.compact ? RTC_SCENE_FLAG_COMPACT : 0;
+  flags |= config.robust ? RTC_SCENE_FLAG_ROBUST : 0;
+  flags |= (config.dynamic && top_level) ? RTC_SCENE_FLAG_DYNAMIC : 0;
+  return static_cast<RTCSceneFlags>(flags);
+}
+
+template<size_t N>
+struct RayPacket;
+
+template<>
+struct RayPacket<4> final
+{
+  using RayHit = RTCRayHit4;
+
+  static void intersect(const int* valid, RTCScene scene, RayHit* ray_hit, RTCIntersectArguments* args)
+  {
+    rtcIntersect4(valid, scene, ray_hit, args);
+  }
+};
+
+template<>
+struct RayPacket<8> final
+{
+  using RayHit = RTCRayHit8;
+
+  static void intersect(const int* valid, RTCScene scene, RayHit* ray_hit, RTCIntersectArguments* args)
+  {
+    rtcIntersect8(valid, scene, ray_hit, args);
+  }
+};
+
+template<>
+struct RayPacket<16> final
+{
+  using RayHit = RTCRayHit16;
+
+  static void intersect(const int* valid, RTCScene scene, RayHit* ray_hit, RTCIntersectArguments* args)
+  {
+    rtcIntersect16(valid, scene, ray_hit, args);
+  }
+};
+
+/**
+ * @brief Traces rays straight down in packets of N, see @ref Scene::intersect_down.
+ * */
+template<size_t N>
+void
+intersect_down_packets(RTCScene scene,
+                       const Vec2f* points,
+                       const size_t count,
+                       const float z,
+                       unsigned int* geom_ids,
+                       float* distances)
+{
+  using Packet = RayPacket<N>;
+
+  RTCIntersectArguments args;
+  rtcInitIntersectArguments(&args);
+  args.flags = RTC_RAY_QUERY_FLAG_COHERENT;
+
+  for (size_t first = 0; first < count; first += N) {
+
+    const auto n = ((count - first) < N) ? (count - first) : N;
+
+    // Embree reads the mask with aligned vector loads, so it has to be aligned to the packet width.
+    alignas(sizeof(int) * N) int valid[N];
+
+    typename Packet::RayHit ray_hit{};
+
+    for (size_t i = 0; i < N; i++) {
+      const auto& p = points[first + ((i < n) ? i : 0)];
+      valid[i] = (i < n) ? -1 : 0;
+      ray_hit.ray.org_x[i] = p[0];
+      ray_hit.ray.org_y[i] = p[1];
+      ray_hit.ray.org_z[i] = z;
+      ray_hit.ray.dir_x[i] = 0.0F;
+      ray_hit.ray.dir_y[i] = 0.0F;
+      ray_hit.ray.dir_z[i] = -1.0F;
+      ray_hit.ray.tfar[i] = static_cast<float>(INFINITY);
+      ray_hit.ray.mask[i] = -1;
+      ray_hit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+      ray_hit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+    }
+
+    Packet::intersect(valid, scene, &ray_hit, &args);
+
+    for (size_t i = 0; i < n; i++) {
+      geom_ids[first + i] = ray_hit.hit.geomID[i];
+      if (distances) {
+        distances[first + i] = ray_hit.ray.tfar[i];
+      }
+    }
+  }
+}
+
+} // namespace
+
+NeuronGeometry::NeuronGeometry(RTCDevice device)
+  : device_(device)
+  , scene_(rtcNewScene(device))
   , soma_spherical_(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_SPHERE_POINT))
   , soma_composite_(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE))
-  , neurites_(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE))
 {
 }
 
-Scene::~Scene()
+NeuronGeometry::~NeuronGeometry()
 {
   rtcReleaseGeometry(soma_spherical_);
   rtcReleaseGeometry(soma_composite_);
-  rtcReleaseGeometry(neurites_);
+  if (neurites_) {
+    rtcReleaseGeometry(neurites_);
+  }
+  if (short_neurites_) {
+    rtcReleaseGeometry(short_neurites_);
+  }
   rtcReleaseScene(scene_);
 }
 
 auto
-Scene::from_swc_model(const SWCModel& model, const Transform& t) -> bool
+NeuronGeometry::build(const SWCModel& model, const SceneConfig& config) -> bool
 {
-  size_t num_neurites = 0;
+  compute_model_bounds(model);
+
+  const auto num_somas = build_somas(model);
+
+  if (!build_neurites(model, config) || !build_footprint()) {
+    return false;
+  }
+
+  commit(num_somas, config);
+
+  return true;
+}
+
+auto
+NeuronGeometry::build(const SWCModel& model, const SceneConfig& config, const Transform& t, const ClipRect& clip)
+  -> bool
+{
+  compute_model_bounds(model);
+
+  const auto num_somas = build_somas(model);
+
+  if (!build_clipped_neurites(model, config, t, clip) || !build_footprint()) {
+    return false;
+  }
+
+  commit(num_somas, config);
+
+  return true;
+}
+
+void
+NeuronGeometry::compute_model_bounds(const SWCModel& model)
+{
+  const size_t num_nodes = model.num_nodes();
+
+  const auto* x = model.x();
+  const auto* y = model.y();
+  const auto* z = model.z();
+  const auto* radii = model.radii();
+
+  auto lower_x = static_cast<float>(INFINITY);
+  auto lower_y = static_cast<float>(INFINITY);
+  auto lower_z = static_cast<float>(INFINITY);
+  auto upper_x = -static_cast<float>(INFINITY);
+  auto upper_y = -static_cast<float>(INFINITY);
+  auto upper_z = -static_cast<float>(INFINITY);
+
+#pragma omp parallel for reduction(min : lower_x, lower_y, lower_z) reduction(max : upper_x, upper_y, upper_z) \
+  if (num_nodes >= parallel_build_threshold)
 
+  for (ssize_t i = 0; i < static_cast<ssize_t>(num_nodes); i++) {
+    const auto r = radii[i];
+    lower_x = (x[i] - r < lower_x) ? (x[i] - r) : lower_x;
+    lower_y = (y[i] - r < lower_y) ? (y[i] - r) : lower_y;
+    lower_z = (z[i] - r < lower_z) ? (z[i] - r) : lower_z;
+    upper_x = (x[i] + r > upper_x) ? (x[i] + r) : upper_x;
+    upper_y = (y[i] + r > upper_y) ? (y[i] + r) : upper_y;
+    upper_z = (z[i] + r > upper_z) ? (z[i] + r) : upper_z;
+  }
+
+  model_bounds_ = RTCBounds{};
+  model_bounds_.lower_x = lower_x;
+  model_bounds_.lower_y = lower_y;
+  model_bounds_.lower_z = lower_z;
+  model_bounds_.upper_x = upper_x;
+  model_bounds_.upper_y = upper_y;
+  model_bounds_.upper_z = upper_z;
+}
+
+auto
+NeuronGeometry::build_somas(const SWCModel& model) -> size_t
+{
   size_t num_somas = 0;
 
+  size_t num_soma_segments = 0;
+
   const size_t num_nodes = model.num_nodes();
 
-  /* First we count the number of neurites (stem like structures extending from the soma)
-   * and the number of soma nodes. The geometric model of a soma is dependent on the number
+  const auto* types = model.types();
+  const auto* x = model.x();
+  const auto* y = model.y();
+  const auto* z = model.z();
+  const auto* radii = model.radii();
+  const auto* parents = model.parent_indices();
+
+  /* First we count the number of soma nodes. The geometric model of a soma is dependent on the number
    * of nodes found. When only one node is found, it is modeled as a sphere. When more than
    * one node is found, it is modeled the same as a neurite.
    */
 
-  for (size_t i = 0; i < num_nodes; i++) {
-    const auto* node = model.find_node(i + 1);
-    if (!node) {
-      continue;
-    }
+#pragma omp parallel for reduction(+ : num_somas, num_soma_segments) if (num_nodes >= parallel_build_threshold)
 
-    switch (node->type) {
-      case SWCType::UNDEFINED:
-      case SWCType::CUSTOM:
-        break;
-      case SWCType::GLIA_PROCESSES:
-        // TODO
-        break;
-      case SWCType::SOMA:
-        num_somas++;
-        break;
-      case SWCType::BASAL_DENDRITE:
-      case SWCType::APICAL_DENDRITE:
-      case SWCType::AXON:
-      case SWCType::UNSPECIFIED_NEURITE:
-        if (model.find_node(node->parent) != nullptr) {
-          // only count it if it has a valid parent
-          num_neurites++;
-        }
-        break;
+  for (ssize_t i = 0; i < static_cast<ssize_t>(num_nodes); i++) {
+    if (types[i] == SWCType::SOMA) {
+      num_somas++;
+      num_soma_segments += (parents[i] != SWCModel::invalid_index) ? 1 : 0;
     }
   }
 
@@ -70,83 +397,857 @@ Scene::from_swc_model(const SWCModel& model, const Transform& t) -> bool
       soma_spherical_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_somas));
   } else {
     soma_buffer = static_cast<Vec4f*>(rtcSetNewGeometryBuffer(
-      soma_composite_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_somas * 2));
+      soma_composite_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_soma_segments * 2));
     soma_indices = static_cast<unsigned int*>(rtcSetNewGeometryBuffer(
-      soma_composite_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_somas));
+      soma_composite_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_soma_segments));
   }
 
+  size_t soma_offset = 0;
+
+  // The soma nodes are normally the first few, so this stops as soon as the last of them has been seen.
+  for (size_t i = 0, seen = 0; (i < num_nodes) && (seen < num_somas); i++) {
+    const auto parent = parents[i];
+    if (types[i] != SWCType::SOMA) {
+      continue;
+    }
+    seen++;
+    if (num_somas == 1) {
+      soma_buffer[0] = Vec4f{ x[i], y[i], z[i], radii[i] };
+    } else if (parent != SWCModel::invalid_index) {
+      soma_buffer[soma_offset * 2 + 0] = Vec4f{ x[parent], y[parent], z[parent], radii[parent] };
+      soma_buffer[soma_offset * 2 + 1] = Vec4f{ x[i], y[i], z[i], radii[i] };
+      soma_indices[soma_offset] = soma_offset * 2;
+      soma_offset++;
+    }
+  }
+
+  if (num_somas == 1) {
+    soma_sphere_ = soma_buffer;
+  } else {
+    soma_segments_ = CurveBuffers{ soma_buffer, soma_indices, num_soma_segments };
+  }
+
+  return num_somas;
+}
+
+auto
+NeuronGeometry::build_neurites(const SWCModel& model, const SceneConfig& config) -> bool
+{
+  /* Neurites (stem like structures extending from the soma) are laid out by the model, in the layout documented
+   * on SWCModel::write_neurite_geometry. A model that shares its geometry has them ready to be used in place.
+   */
+
+  neurites_ = rtcNewGeometry(device_, neurite_geometry_type(config.neurite_curve));
+
+  size_t num_neurites = 0;
+
+  size_t num_neurite_vertices = 0;
+
+  if (config.neurite_curve != NeuriteCurve::LINEAR) {
+    NeuriteLayout layout;
+    return write_layout(model, &layout) &&
+           set_curve_neurites(
+             layout.vertices.data(), layout.indices.data(), layout.types.data(), layout.indices.size(), config);
+  }
+
+  if (model.has_shared_geometry()) {
+    shared_neurites_ = model.shared_geometry();
+    const auto& shared = *shared_neurites_;
+    num_neurites = shared.num_segments();
+    num_neurite_vertices = shared.num_vertices();
+    rtcSetSharedGeometryBuffer(neurites_,
+                               RTC_BUFFER_TYPE_INDEX,
+                               0,
+                               RTC_FORMAT_UINT,
+                               shared.indices(),
+                               0,
+                               sizeof(unsigned int),
+                               num_neurites);
+    rtcSetSharedGeometryBuffer(neurites_,
+                               RTC_BUFFER_TYPE_VERTEX,
+                               0,
+                               RTC_FORMAT_FLOAT4,
+                               shared.vertices(),
+                               0,
+                               sizeof(float) * 4,
+                               num_neurite_vertices);
+    neurite_types_ = shared.types();
+    num_neurites_ = num_neurites;
+    neurite_buffers_ = CurveBuffers{ shared.vertices(), shared.indices(), num_neurites };
+    return true;
+  }
+
+  model.count_neurite_geometry(&num_neurites, &num_neurite_vertices);
+
   auto* neurites_indices = static_cast<unsigned int*>(
     rtcSetNewGeometryBuffer(neurites_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_neurites));
 
   auto* neurites_buffer = static_cast<Vec4f*>(rtcSetNewGeometryBuffer(
-    neurites_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_neurites * 2));
+    neurites_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_neurite_vertices));
 
-  if (!neurite_types_.resize(num_neurites)) {
+  if (!own_neurite_types_.resize(num_neurites) ||
+      !model.write_neurite_geometry(neurites_buffer, neurites_indices, own_neurite_types_.data())) {
     return false;
   }
 
-  size_t soma_offset = 0;
+  neurite_types_ = own_neurite_types_.data();
+  num_neurites_ = num_neurites;
+  neurite_buffers_ = CurveBuffers{ neurites_buffer, neurites_indices, num_neurites };
+
+  return true;
+}
+
+auto
+NeuronGeometry::build_clipped_neurites(const SWCModel& model,
+                                       const SceneConfig& config,
+                                       const Transform& t,
+                                       const ClipRect& clip) -> bool
+{
+  /* The full layout is written to scratch space first, and then the segments that overlap the rectangle are copied
+   * out of it. Segments that were sharing a vertex before keep sharing it if both of them are kept.
+   */
+
+  neurites_ = rtcNewGeometry(device_, neurite_geometry_type(config.neurite_curve));
+
+  NeuriteLayout layout;
+
+  NeuriteLayout clipped;
+
+  if (!write_layout(model, &layout)) {
+    return false;
+  }
+
+  float m[12];
+  t.to_matrix(m);
+
+  const auto num_segments = layout.indices.size();
+
+  auto& indices = layout.indices;
+
+  const auto& vertices = layout.vertices;
+
+  size_t num_neurites = 0;
+
+  size_t num_neurite_vertices = 0;
+
+  size_t last_vertex = SWCModel::invalid_index;
+
+  // Reuses the index array to mark the kept segments, since each segment only reads its own entry.
+  for (size_t s = 0; s < num_segments; s++) {
+    const auto first = indices[s];
+    if (!overlaps(vertices[first], vertices[first + 1], m, clip)) {
+      indices[s] = SWCModel::invalid_index;
+      continue;
+    }
+    num_neurites++;
+    num_neurite_vertices += (last_vertex == first) ? 1 : 2;
+    last_vertex = first + 1;
+  }
+
+  if (!clipped.vertices.resize(num_neurite_vertices) || !clipped.indices.resize(num_neurites) ||
+      !clipped.types.resize(num_neurites)) {
+    return false;
+  }
 
   size_t neurites_offset = 0;
 
-  for (size_t i = 0; i < num_nodes; i++) {
-    const auto* node = model.find_node(i + 1);
-    if (!node) {
+  size_t vertex_offset = 0;
+
+  last_vertex = SWCModel::invalid_index;
+
+  for (size_t s = 0; s < num_segments; s++) {
+    const auto first = indices[s];
+    if (first == SWCModel::invalid_index) {
       continue;
     }
+    if (last_vertex != first) {
+      clipped.vertices[vertex_offset++] = vertices[first];
+    }
+    clipped.indices[neurites_offset] = static_cast<uint32_t>(vertex_offset - 1);
+    clipped.vertices[vertex_offset++] = vertices[first + 1];
+    clipped.types[neurites_offset] = layout.types[s];
+    neurites_offset++;
+    last_vertex = first + 1;
+  }
 
-    const auto* parent = model.find_node(node->parent);
-
-    switch (node->type) {
-      case SWCType::UNDEFINED:
-      case SWCType::CUSTOM:
-        break;
-      case SWCType::GLIA_PROCESSES:
-        // TODO
-        break;
-      case SWCType::SOMA:
-        if (num_somas == 1) {
-          soma_buffer[soma_offset] = Vec4f{ node->position[0], node->position[1], node->position[2], node->radius };
-        } else if (parent != nullptr) {
-          const auto p0 = t.apply(parent->position);
-          const auto p1 = t.apply(node->position);
-          soma_buffer[soma_offset * 2 + 0] = Vec4f{ p0[0], p0[1], p0[2], parent->radius };
-          soma_buffer[soma_offset * 2 + 1] = Vec4f{ p1[0], p1[1], p1[2], node->radius };
-          soma_indices[soma_offset] = soma_offset * 2;
-        }
-        soma_offset++;
-        break;
-      case SWCType::BASAL_DENDRITE:
-      case SWCType::APICAL_DENDRITE:
-      case SWCType::AXON:
-      case SWCType::UNSPECIFIED_NEURITE:
-        if (parent) {
-          const Vec3f p0 = t.apply(parent->position);
-          const Vec3f p1 = t.apply(node->position);
-          neurites_buffer[neurites_offset * 2 + 0] = Vec4f{ p0[0], p0[1], p0[2], parent->radius };
-          neurites_buffer[neurites_offset * 2 + 1] = Vec4f{ p1[0], p1[1], p1[2], node->radius };
-          neurites_indices[neurites_offset] = neurites_offset * 2;
-          neurite_types_[neurites_offset] = static_cast<uint8_t>(node->type);
-          neurites_offset++;
-        }
-        break;
+  if (config.neurite_curve != NeuriteCurve::LINEAR) {
+    return set_curve_neurites(
+      clipped.vertices.data(), clipped.indices.data(), clipped.types.data(), num_neurites, config);
+  }
+
+  return set_linear_neurites(clipped.vertices.data(), clipped.indices.data(), clipped.types.data(), num_neurites);
+}
+
+auto
+NeuronGeometry::set_linear_neurites(const Vec4f* vertices,
+                                    const uint32_t* indices,
+                                    const uint8_t* types,
+                                    const size_t num_segments) -> bool
+{
+  const auto num_vertices = (num_segments > 0) ? (indices[num_segments - 1] + 2) : 0;
+
+  auto* neurites_indices = static_cast<unsigned int*>(
+    rtcSetNewGeometryBuffer(neurites_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_segments));
+
+  auto* neurites_buffer = static_cast<Vec4f*>(rtcSetNewGeometryBuffer(
+    neurites_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_vertices));
+
+  if (!own_neurite_types_.resize(num_segments)) {
+    return false;
+  }
+
+  memcpy(neurites_indices, indices, num_segments * sizeof(uint32_t));
+  memcpy(neurites_buffer, vertices, num_vertices * sizeof(Vec4f));
+  memcpy(own_neurite_types_.data(), types, num_segments);
+
+  neurite_types_ = own_neurite_types_.data();
+  num_neurites_ = num_segments;
+  neurite_buffers_ = CurveBuffers{ neurites_buffer, neurites_indices, num_segments };
+
+  return true;
+}
+
+auto
+NeuronGeometry::set_curve_neurites(const Vec4f* vertices,
+                                   const uint32_t* indices,
+                                   const uint8_t* types,
+                                   const size_t num_segments,
+                                   const SceneConfig& config) -> bool
+{
+  /* An unbranched run is a sequence of segments where each one starts at the vertex the previous one ended at, and
+   * which all have the same type. Every stride th vertex of a run becomes a control point, along with its last
+   * vertex. The end points are repeated, once for Catmull-Rom splines since they pass through all but the outer
+   * control points, and twice for B-splines, which then start and end exactly at the ends of the run. Short runs
+   * would not get any fewer primitives from a B-spline, so they are copied to a round linear geometry instead.
+   */
+
+  const size_t stride = (config.curve_stride > 0) ? config.curve_stride : 1;
+
+  const size_t repeats = (config.neurite_curve == NeuriteCurve::BSPLINE) ? 2 : 1;
+
+  const auto is_short = [&](const size_t num_edges) {
+    return (config.neurite_curve == NeuriteCurve::BSPLINE) && (num_edges <= max_linear_run_edges);
+  };
+
+  const auto run_end = [&](size_t s) {
+    const auto type = types[s];
+    while ((s + 1 < num_segments) && (indices[s + 1] == indices[s] + 1) && (types[s + 1] == type)) {
+      s++;
+    }
+    return s + 1;
+  };
+
+  // A run of n edges has (n + stride - 1) / stride + 1 control points, plus the repeated end points.
+  const auto run_control_points = [&](const size_t num_edges) {
+    return (num_edges + stride - 1) / stride + 1 + 2 * repeats;
+  };
+
+  size_t num_control_points = 0;
+
+  size_t num_curves = 0;
+
+  size_t num_short_segments = 0;
+
+  for (size_t s = 0; s < num_segments;) {
+    const auto end = run_end(s);
+    if (is_short(end - s)) {
+      num_short_segments += end - s;
+    } else {
+      const auto n = run_control_points(end - s);
+      num_control_points += n;
+      num_curves += n - 3;
     }
+    s = end;
+  }
+
+  auto* curve_indices = static_cast<unsigned int*>(
+    rtcSetNewGeometryBuffer(neurites_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_curves));
+
+  auto* control_points = static_cast<Vec4f*>(rtcSetNewGeometryBuffer(
+    neurites_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_control_points));
+
+  if (!own_neurite_types_.resize(num_curves + num_short_segments)) {
+    return false;
+  }
+
+  // Each short segment gets both of its end points, so the segments of a run do not need to be adjacent.
+  unsigned int* short_indices{};
+
+  Vec4f* short_vertices{};
+
+  if (num_short_segments > 0) {
+    short_neurites_ = rtcNewGeometry(device_, RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE);
+    short_indices = static_cast<unsigned int*>(rtcSetNewGeometryBuffer(
+      short_neurites_, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), num_short_segments));
+    short_vertices = static_cast<Vec4f*>(rtcSetNewGeometryBuffer(
+      short_neurites_, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(float) * 4, num_short_segments * 2));
   }
 
+  size_t point = 0;
+
+  size_t curve = 0;
+
+  size_t short_segment = 0;
+
+  for (size_t s = 0; s < num_segments;) {
+
+    const auto end = run_end(s);
+
+    if (is_short(end - s)) {
+      for (auto k = s; k < end; k++) {
+        short_vertices[short_segment * 2 + 0] = vertices[indices[k]];
+        short_vertices[short_segment * 2 + 1] = vertices[indices[k] + 1];
+        short_indices[short_segment] = static_cast<unsigned int>(short_segment * 2);
+        own_neurite_types_[num_curves + short_segment] = types[k];
+        short_segment++;
+      }
+      s = end;
+      continue;
+    }
+
+    const auto first_vertex = indices[s];
+
+    const auto last_vertex = indices[end - 1] + 1;
+
+    const auto first_point = point;
+
+    for (size_t r = 0; r < repeats; r++) {
+      control_points[point++] = vertices[first_vertex];
+    }
+
+    for (auto v = first_vertex; v < last_vertex; v += stride) {
+      control_points[point++] = vertices[v];
+    }
+
+    for (size_t r = 0; r <= repeats; r++) {
+      control_points[point++] = vertices[last_vertex];
+    }
+
+    for (auto p = first_point; p + 3 < point; p++) {
+      curve_indices[curve] = static_cast<unsigned int>(p);
+      own_neurite_types_[curve] = types[s];
+      curve++;
+    }
+
+    s = end;
+  }
+
+  neurite_types_ = own_neurite_types_.data();
+  num_neurites_ = num_curves;
+  num_short_neurites_ = num_short_segments;
+  neurite_buffers_ = CurveBuffers{ control_points, curve_indices, num_curves };
+  short_neurite_buffers_ = CurveBuffers{ short_vertices, short_indices, num_short_segments };
+  neurite_curve_ = config.neurite_curve;
+
+  return true;
+}
+
+auto
+NeuronGeometry::build_footprint() -> bool
+{
+  const auto& soma = soma_segments_;
+  const auto& neurites = neurite_buffers_;
+
+  const auto& short_neurites = short_neurite_buffers_;
+
+  const auto soma_runs = (soma.num_primitives + footprint_run - 1) / footprint_run;
+  const auto neurite_runs = (neurites.num_primitives + footprint_run - 1) / footprint_run;
+  const auto short_runs = (short_neurites.num_primitives + footprint_run - 1) / footprint_run;
+
+  if (!footprint_.resize((soma_sphere_ ? 1 : 0) + soma_runs + neurite_runs + short_runs)) {
+    return false;
+  }
+
+  size_t count = 0;
+
+  if (soma_sphere_) {
+    footprint_[count] = empty_bounds();
+    grow_bounds(&footprint_[count++], soma_sphere_, 1, 0.0F);
+  }
+
+  for (size_t i = 0; i < soma_runs; i++) {
+    auto& bounds = footprint_[count++];
+    bounds = empty_bounds();
+    const auto last = ((i + 1) * footprint_run < soma.num_primitives) ? (i + 1) * footprint_run : soma.num_primitives;
+    for (auto j = i * footprint_run; j < last; j++) {
+      grow_bounds(&bounds, soma.vertices + soma.indices[j], 2, 0.0F);
+    }
+  }
+
+  /* B-splines stay within the hull of their control points, but Catmull-Rom splines can overshoot it by up to an
+   * eighth of its size, so their bounds are grown by a quarter to stay conservative.
+   */
+
+  const size_t num_points = (neurite_curve_ == NeuriteCurve::LINEAR) ? 2 : 4;
+
+  const auto growth = (neurite_curve_ == NeuriteCurve::CATMULL_ROM) ? 0.25F : 0.0F;
+
+  for (size_t i = 0; i < neurite_runs; i++) {
+    auto& bounds = footprint_[count++];
+    bounds = empty_bounds();
+    const auto last =
+      ((i + 1) * footprint_run < neurites.num_primitives) ? (i + 1) * footprint_run : neurites.num_primitives;
+    for (auto j = i * footprint_run; j < last; j++) {
+      grow_bounds(&bounds, neurites.vertices + neurites.indices[j], num_points, growth);
+    }
+  }
+
+  for (size_t i = 0; i < short_runs; i++) {
+    auto& bounds = footprint_[count++];
+    bounds = empty_bounds();
+    const auto last = ((i + 1) * footprint_run < short_neurites.num_primitives) ? (i + 1) * footprint_run
+                                                                                 : short_neurites.num_primitives;
+    for (auto j = i * footprint_run; j < last; j++) {
+      grow_bounds(&bounds, short_neurites.vertices + short_neurites.indices[j], 2, 0.0F);
+    }
+  }
+
+  return true;
+}
+
+void
+NeuronGeometry::commit(const size_t num_somas, const SceneConfig& config)
+{
+  rtcSetGeometryBuildQuality(soma_spherical_, config.build_quality);
+  rtcSetGeometryBuildQuality(soma_composite_, config.build_quality);
+  rtcSetGeometryBuildQuality(neurites_, config.build_quality);
+  if (short_neurites_) {
+    rtcSetGeometryBuildQuality(short_neurites_, config.build_quality);
+  }
+
+  rtcSetSceneBuildQuality(scene_, scene_build_quality(config.build_quality));
+  rtcSetSceneFlags(scene_, scene_flags(config, false));
+
   if (num_somas == 1) {
     rtcCommitGeometry(soma_spherical_);
-    soma_id_ = rtcAttachGeometry(scene_, soma_spherical_);
+    rtcAttachGeometryByID(scene_, soma_spherical_, soma_id);
   } else if (num_somas > 0) {
     rtcCommitGeometry(soma_composite_);
-    soma_id_ = rtcAttachGeometry(scene_, soma_composite_);
+    rtcAttachGeometryByID(scene_, soma_composite_, soma_id);
   }
 
-  if (num_neurites > 0) {
+  if (num_neurites_ > 0) {
     rtcCommitGeometry(neurites_);
-    neurites_id_ = rtcAttachGeometry(scene_, neurites_);
+    rtcAttachGeometryByID(scene_, neurites_, neurites_id);
+  }
+
+  if (num_short_neurites_ > 0) {
+    rtcCommitGeometry(short_neurites_);
+    rtcAttachGeometryByID(scene_, short_neurites_, short_neurites_id);
   }
 
   rtcCommitScene(scene_);
+}
+
+Scene::Scene(RTCDevice device)
+  : device_(device)
+  , scene_(rtcNewScene(device))
+  , packet_size_(native_ray_packet_size(device))
+{
+  set_config(config_);
+}
+
+Scene::~Scene()
+{
+  clear();
+  rtcReleaseScene(scene_);
+}
+
+void
+Scene::set_config(const SceneConfig& config)
+{
+  config_ = config;
+
+  rtcSetSceneBuildQuality(scene_, scene_build_quality(config.instance_build_quality));
+  rtcSetSceneFlags(scene_, scene_flags(config, true));
+}
+
+auto
+Scene::from_swc_model(const SWCModel& model, const Transform& t) -> bool
+{
+  clear();
+
+  if (add_neuron(model, t) == RTC_INVALID_GEOMETRY_ID) {
+    return false;
+  }
+
+  commit();
 
   return true;
 }
+
+auto
+Scene::add_neuron(const SWCModel& model, const Transform& t) -> unsigned int
+{
+  // Clipped geometry depends on the transform, so it is never shared.
+  auto prototype = clipped_ ? prototypes_.size() : find_prototype(model.generation());
+
+  if (prototype == prototypes_.size()) {
+
+    auto* geometry = new NeuronGeometry(device_);
+
+    const auto built = clipped_ ? geometry->build(model, config_, t, clip_rect_) : geometry->build(model, config_);
+
+    auto* slot = built ? prototypes_.append() : nullptr;
+    if (!slot) {
+      delete geometry;
+      return RTC_INVALID_GEOMETRY_ID;
+    }
+
+    *slot = Prototype{ geometry, clipped_ ? 0 : model.generation() };
+
+    // Clipped prototypes, and those of models that were never loaded, are not shared, so they are not indexed.
+    if ((slot->generation != 0) && !index_last_prototype()) {
+      delete geometry;
+      prototypes_.pop_back();
+      return RTC_INVALID_GEOMETRY_ID;
+    }
+  }
+
+  auto* instance = instances_.append();
+  if (!instance) {
+    return RTC_INVALID_GEOMETRY_ID;
+  }
+
+  const auto instance_id = static_cast<unsigned int>(instances_.size() - 1);
+
+  instance->geometry = rtcNewGeometry(device_, RTC_GEOMETRY_TYPE_INSTANCE);
+  instance->prototype = static_cast<uint32_t>(prototype);
+
+  rtcSetGeometryInstancedScene(instance->geometry, prototypes_[prototype].geometry->scene());
+
+  // The instance was just appended, so its ID is always in range.
+  (void)set_transform(instance_id, t);
+
+  rtcAttachGeometryByID(scene_, instance->geometry, instance_id);
+
+  return instance_id;
+}
+
+auto
+Scene::find_prototype(const uint64_t generation) const -> size_t
+{
+  if (prototype_index_.size() == 0) {
+    return prototypes_.size();
+  }
+
+  const auto mask = prototype_index_.size() - 1;
+
+  for (auto slot = hash_generation(generation) & mask;; slot = (slot + 1) & mask) {
+    const auto& entry = prototype_index_[slot];
+    if (entry.prototype == invalid_prototype) {
+      return prototypes_.size();
+    }
+    if (entry.generation == generation) {
+      return entry.prototype;
+    }
+  }
+}
+
+auto
+Scene::index_last_prototype() -> bool
+{
+  const auto prototype = prototypes_.size() - 1;
+
+  // Rebuilding from the prototypes keeps the load factor at or below one half.
+  if ((prototypes_.size() * 2) > prototype_index_.size()) {
+
+    size_t capacity{ 16 };
+    while (capacity < (prototypes_.size() * 2)) {
+      capacity *= 2;
+    }
+
+    if (!prototype_index_.resize(capacity)) {
+      return false;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+      prototype_index_[i] = PrototypeIndexEntry{ 0, invalid_prototype };
+    }
+
+    const auto mask = capacity - 1;
+
+    for (size_t i = 0; i < prototypes_.size(); i++) {
+      const auto generation = prototypes_[i].generation;
+      if (generation == 0) {
+        continue;
+      }
+      auto slot = hash_generation(generation) & mask;
+      while (prototype_index_[slot].prototype != invalid_prototype) {
+        slot = (slot + 1) & mask;
+      }
+      prototype_index_[slot] = PrototypeIndexEntry{ generation, static_cast<uint32_t>(i) };
+    }
+
+    return true;
+  }
+
+  const auto mask = prototype_index_.size() - 1;
+
+  auto slot = hash_generation(prototypes_[prototype].generation) & mask;
+  while (prototype_index_[slot].prototype != invalid_prototype) {
+    slot = (slot + 1) & mask;
+  }
+
+  prototype_index_[slot] = PrototypeIndexEntry{ prototypes_[prototype].generation, static_cast<uint32_t>(prototype) };
+
+  return true;
+}
+
+auto
+Scene::unclipped_bounds() const -> RTCBounds
+{
+  RTCBounds bounds{};
+  bounds.lower_x = static_cast<float>(INFINITY);
+  bounds.lower_y = static_cast<float>(INFINITY);
+  bounds.lower_z = static_cast<float>(INFINITY);
+  bounds.upper_x = -static_cast<float>(INFINITY);
+  bounds.upper_y = -static_cast<float>(INFINITY);
+  bounds.upper_z = -static_cast<float>(INFINITY);
+
+  for (size_t i = 0; i < instances_.size(); i++) {
+
+    const auto& local = prototypes_[instances_[i].prototype].geometry->model_bounds();
+
+    // A model without nodes has empty bounds.
+    if (!(local.lower_x <= local.upper_x)) {
+      continue;
+    }
+
+    float m[12];
+    instances_[i].transform.to_matrix(m);
+
+    // The corners of the box, placed in the scene.
+    for (int corner = 0; corner < 8; corner++) {
+      const auto x = (corner & 1) ? local.upper_x : local.lower_x;
+      const auto y = (corner & 2) ? local.upper_y : local.lower_y;
+      const auto z = (corner & 4) ? local.upper_z : local.lower_z;
+      const Vec3f p{ m[0] * x + m[1] * y + m[2] * z + m[3],
+                     m[4] * x + m[5] * y + m[6] * z + m[7],
+                     m[8] * x + m[9] * y + m[10] * z + m[11] };
+      bounds.lower_x = (p[0] < bounds.lower_x) ? p[0] : bounds.lower_x;
+      bounds.lower_y = (p[1] < bounds.lower_y) ? p[1] : bounds.lower_y;
+      bounds.lower_z = (p[2] < bounds.lower_z) ? p[2] : bounds.lower_z;
+      bounds.upper_x = (p[0] > bounds.upper_x) ? p[0] : bounds.upper_x;
+      bounds.upper_y = (p[1] > bounds.upper_y) ? p[1] : bounds.upper_y;
+      bounds.upper_z = (p[2] > bounds.upper_z) ? p[2] : bounds.upper_z;
+    }
+  }
+
+  return bounds;
+}
+
+void
+Scene::set_clip_rect(const ClipRect& clip)
+{
+  clip_rect_ = clip;
+  clipped_ = true;
+}
+
+void
+Scene::clear_clip_rect()
+{
+  clipped_ = false;
+}
+
+auto
+Scene::set_transform(const unsigned int instance_id, const Transform& t) -> bool
+{
+  if (instance_id >= instances_.size()) {
+    return false;
+  }
+
+  float matrix[12];
+  t.to_matrix(matrix);
+
+  instances_[instance_id].transform = t;
+
+  auto geometry = instances_[instance_id].geometry;
+
+  rtcSetGeometryTransform(geometry, 0, RTC_FORMAT_FLOAT3X4_ROW_MAJOR, matrix);
+  rtcCommitGeometry(geometry);
+
+  return true;
+}
+
+void
+Scene::intersect_down(const Vec2f* points,
+                      const size_t count,
+                      const float z,
+                      unsigned int* geom_ids,
+                      float* distances) const
+{
+  switch (packet_size_) {
+    case 16:
+      intersect_down_packets<16>(scene_, points, count, z, geom_ids, distances);
+      break;
+    case 8:
+      intersect_down_packets<8>(scene_, points, count, z, geom_ids, distances);
+      break;
+    default:
+      intersect_down_packets<4>(scene_, points, count, z, geom_ids, distances);
+      break;
+  }
+}
+
+void
+Scene::commit()
+{
+  rtcCommitScene(scene_);
+
+  occupancy_.build(*this, config_.occupancy_grid_size);
+}
+
+void
+Scene::clear()
+{
+  for (size_t i = 0; i < instances_.size(); i++) {
+    rtcDetachGeometry(scene_, static_cast<unsigned int>(i));
+    rtcReleaseGeometry(instances_[i].geometry);
+  }
+
+  for (size_t i = 0; i < prototypes_.size(); i++) {
+    delete prototypes_[i].geometry;
+  }
+
+  (void)instances_.resize(0);
+  (void)prototypes_.resize(0);
+  (void)prototype_index_.resize(0);
+
+  occupancy_.reset();
+}
+
+void
+OccupancyGrid::build(const Scene& scene, const size_t resolution)
+{
+  reset();
+
+  const auto bounds = scene.get_bounds();
+
+  // An empty scene has inverted (or infinite) bounds.
+  if (!(bounds.lower_x <= bounds.upper_x) || !(bounds.lower_y <= bounds.upper_y)) {
+    return;
+  }
+
+  bounds_ = ClipRect{ bounds.lower_x, bounds.lower_y, bounds.upper_x, bounds.upper_y };
+  empty_ = false;
+
+  const auto extent_x = bounds.upper_x - bounds.lower_x;
+  const auto extent_y = bounds.upper_y - bounds.lower_y;
+  const auto extent = (extent_x > extent_y) ? extent_x : extent_y;
+
+  if ((resolution == 0) || !(extent > 0.0F) || !isfinite(extent)) {
+    return;
+  }
+
+  cell_size_ = extent / static_cast<float>(resolution);
+
+  const auto cells_x = static_cast<size_t>(ceilf(extent_x / cell_size_));
+  const auto cells_y = static_cast<size_t>(ceilf(extent_y / cell_size_));
+
+  width_ = clamp<size_t>(cells_x, 1, resolution);
+  height_ = clamp<size_t>(cells_y, 1, resolution);
+
+  if (!cells_.resize(width_ * height_)) {
+    width_ = 0;
+    height_ = 0;
+    return;
+  }
+
+  memset(cells_.data(), 0, cells_.size());
+
+  for (size_t i = 0; i < scene.num_neurons(); i++) {
+
+    const auto instance_id = static_cast<unsigned int>(i);
+
+    const auto& footprint = scene.neuron_geometry(instance_id).footprint();
+
+    float m[12];
+    scene.neuron_transform(instance_id).to_matrix(m);
+
+    // Each box is placed by its center, with its half extents projected onto the world axes.
+    for (size_t j = 0; j < footprint.size(); j++) {
+      const auto& b = footprint[j];
+      const float c[3]{ (b.lower_x + b.upper_x) * 0.5F,
+                        (b.lower_y + b.upper_y) * 0.5F,
+                        (b.lower_z + b.upper_z) * 0.5F };
+      const float e[3]{ (b.upper_x - b.lower_x) * 0.5F,
+                        (b.upper_y - b.lower_y) * 0.5F,
+                        (b.upper_z - b.lower_z) * 0.5F };
+      const auto x = m[0] * c[0] + m[1] * c[1] + m[2] * c[2] + m[3];
+      const auto y = m[4] * c[0] + m[5] * c[1] + m[6] * c[2] + m[7];
+      const auto ex = fabsf(m[0]) * e[0] + fabsf(m[1]) * e[1] + fabsf(m[2]) * e[2];
+      const auto ey = fabsf(m[4]) * e[0] + fabsf(m[5]) * e[1] + fabsf(m[6]) * e[2];
+      mark(x - ex, y - ey, x + ex, y + ey);
+    }
+  }
+}
+
+void
+OccupancyGrid::reset()
+{
+  (void)cells_.resize(0);
+  width_ = 0;
+  height_ = 0;
+  cell_size_ = 0.0F;
+  bounds_ = ClipRect{};
+  empty_ = true;
+}
+
+auto
+OccupancyGrid::may_overlap(const ClipRect& rect) const -> bool
+{
+  if (empty_ || (rect.upper_x < bounds_.lower_x) || (rect.lower_x > bounds_.upper_x) ||
+      (rect.upper_y < bounds_.lower_y) || (rect.lower_y > bounds_.upper_y)) {
+    return false;
+  }
+
+  if (cells_.size() == 0) {
+    return true;
+  }
+
+  const auto to_cell = [this](const float v, const float lower, const size_t size) -> size_t {
+    const auto cell = (v - lower) / cell_size_;
+    return (cell <= 0.0F) ? 0 : ((cell >= static_cast<float>(size - 1)) ? (size - 1) : static_cast<size_t>(cell));
+  };
+
+  const auto x0 = to_cell(rect.lower_x, bounds_.lower_x, width_);
+  const auto x1 = to_cell(rect.upper_x, bounds_.lower_x, width_);
+  const auto y0 = to_cell(rect.lower_y, bounds_.lower_y, height_);
+  const auto y1 = to_cell(rect.upper_y, bounds_.lower_y, height_);
+
+  for (auto y = y0; y <= y1; y++) {
+    for (auto x = x0; x <= x1; x++) {
+      if (cells_[y * width_ + x]) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void
+OccupancyGrid::mark(const float lower_x, const float lower_y, const float upper_x, const float upper_y)
+{
+  if ((upper_x < bounds_.lower_x) || (lower_x > bounds_.upper_x) || (upper_y < bounds_.lower_y) ||
+      (lower_y > bounds_.upper_y)) {
+    return;
+  }
+
+  const auto to_cell = [this](const float v, const float lower, const size_t size) -> size_t {
+    const auto cell = (v - lower) / cell_size_;
+    return (cell <= 0.0F) ? 0 : ((cell >= static_cast<float>(size - 1)) ? (size - 1) : static_cast<size_t>(cell));
+  };
+
+  const auto x0 = to_cell(lower_x, bounds_.lower_x, width_);
+  const auto x1 = to_cell(upper_x, bounds_.lower_x, width_);
+  const auto y0 = to_cell(lower_y, bounds_.lower_y, height_);
+  const auto y1 = to_cell(upper_y, bounds_.lower_y, height_);
+
+  for (auto y = y0; y <= y1; y++) {
+    for (auto x = x0; x <= x1; x++) {
+      cells_[y * width_ + x] = 1;
+    }
+  }
+}
@@ -10,46 +10,516 @@
 
 #include <embree4/rtcore.h>
 
+#include <memory>
+
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
 
+class NeuriteGeometry;
 class SWCModel;
 
-class Scene final
+/**
+ * @brief The widest ray packet that a device traces natively on this host, which is 16, 8 or 4.
+ *
+ * @details Embree is built for several instruction sets and picks one when it runs, so this is asked of the device
+ *          rather than decided by how this library was compiled.
+ * */
+[[nodiscard]] auto
+native_ray_packet_size(RTCDevice device) -> size_t;
+
+/**
+ * @brief Gets the Embree device shared by scenes that are not tied to a particular microscope.
+ * */
+[[nodiscard]] auto
+default_device() -> RTCDevice;
+
+/**
+ * @brief The kind of curve the neurites are built from.
+ * */
+enum class NeuriteCurve
+{
+  /**
+   * @brief One straight segment per SWC edge, which follows the tracing exactly.
+   * */
+  LINEAR,
+  /**
+   * @brief A Catmull-Rom spline through every @ref SceneConfig::curve_stride th node of each unbranched run.
+   * */
+  CATMULL_ROM,
+  /**
+   * @brief A B-spline with every @ref SceneConfig::curve_stride th node of each unbranched run as a control point.
+   *        It is smoother than a Catmull-Rom spline, but only passes through the ends of each run.
+   *
+   * @note Runs of up to four edges, which are common around branch points, stay round linear segments, since the
+   *       repeated end points would leave them with at least as many curves as edges.
+   * */
+  BSPLINE
+};
+
+/**
+ * @brief Trades BVH build time against traversal speed.
+ * */
+struct SceneConfig final
+{
+  /**
+   * @brief The build quality of the geometry of each model.
+   *
+   * @note RTC_BUILD_QUALITY_REFIT only applies to geometries, so the scene that holds them is then built at low
+   *       quality.
+   * */
+  RTCBuildQuality build_quality{ RTC_BUILD_QUALITY_MEDIUM };
+
+  /**
+   * @brief The build quality of the top level BVH, which is rebuilt every time a neuron moves.
+   * */
+  RTCBuildQuality instance_build_quality{ RTC_BUILD_QUALITY_MEDIUM };
+
+  /**
+   * @brief Uses a more compact BVH layout, at some cost in traversal speed.
+   * */
+  bool compact{ false };
+
+  /**
+   * @brief Avoids optimizations that lose precision, at some cost in traversal speed.
+   * */
+  bool robust{ false };
+
+  /**
+   * @brief Tunes the top level BVH for scenes whose neurons are moved between captures.
+   * */
+  bool dynamic{ false };
+
+  /**
+   * @brief Makes microscopes build only the part of a model that is in view when they capture it.
+   * */
+  bool clip_to_view{ false };
+
+  /**
+   * @brief How far outside of the view segments are still built, in world units, when clipping to the view.
+   * */
+  float clip_margin{ 0.0F };
+
+  NeuriteCurve neurite_curve{ NeuriteCurve::LINEAR };
+
+  /**
+   * @brief The number of SWC edges per curve segment when the neurites are built from splines. The ends of each
+   *        unbranched run are always used.
+   * */
+  unsigned int curve_stride{ 2 };
+
+  /**
+   * @brief The number of cells along the longer side of the occupancy grid built on commit, see
+   *        @ref OccupancyGrid. Zero leaves only the scene bounds to skip empty space with.
+   * */
+  size_t occupancy_grid_size{ 128 };
+};
+
+/**
+ * @brief An axis aligned rectangle in the world XY plane, which is the plane the microscopes image.
+ * */
+struct ClipRect final
+{
+  float lower_x{};
+
+  float lower_y{};
+
+  float upper_x{};
+
+  float upper_y{};
+};
+
+/**
+ * @brief A view of the vertex and index buffers of a curve geometry. Primitive i starts at vertices[indices[i]].
+ * */
+struct CurveBuffers final
+{
+  const Vec4f* vertices{};
+
+  const uint32_t* indices{};
+
+  size_t num_primitives{};
+};
+
+/**
+ * @brief The geometry of one morphology, in the local frame of the model.
+ *
+ * @details Every instance of the same model in a scene shares one of these, and with it one BVH.
+ * */
+class NeuronGeometry final
 {
+  RTCDevice device_;
+
   RTCScene scene_;
 
   RTCGeometry soma_spherical_;
 
   RTCGeometry soma_composite_;
 
-  RTCGeometry neurites_;
+  /**
+   * @brief Created when the geometry is built, since its type depends on @ref SceneConfig::neurite_curve.
+   * */
+  RTCGeometry neurites_{};
+
+  /**
+   * @brief The unbranched runs that are kept as round linear segments when the rest of the neurites are B-splines.
+   *        Only created when there are any.
+   * */
+  RTCGeometry short_neurites_{};
+
+  /**
+   * @brief The geometry of the model when it shares it. Embree reads it in place, so it is kept alive from here.
+   * */
+  std::shared_ptr<const NeuriteGeometry> shared_neurites_;
+
+  /**
+   * @brief The types of the neurite segments. These point into the shared geometry when there is some, or into
+   *        @ref NeuronGeometry::own_neurite_types_ otherwise, where the types of the short neurites follow those of
+   *        the curves.
+   * */
+  const uint8_t* neurite_types_{};
+
+  size_t num_neurites_{};
+
+  size_t num_short_neurites_{};
+
+  Array<uint8_t> own_neurite_types_;
+
+  /**
+   * @brief The buffers given to Embree, kept so the geometry can be read back without going through Embree.
+   * */
+  const Vec4f* soma_sphere_{};
+
+  CurveBuffers soma_segments_;
+
+  CurveBuffers neurite_buffers_;
+
+  CurveBuffers short_neurite_buffers_;
+
+  NeuriteCurve neurite_curve_{ NeuriteCurve::LINEAR };
+
+  /**
+   * @brief The bounds of all of the nodes of the model, grown by their radii. Clipping does not change these.
+   * */
+  RTCBounds model_bounds_{};
+
+  /**
+   * @brief Boxes in the local frame that together cover every primitive, each around a short run of consecutive
+   *        primitives. The occupancy grid only has to place these, rather than walk every primitive on each commit.
+   * */
+  Array<RTCBounds> footprint_;
+
+  void compute_model_bounds(const SWCModel& model);
+
+  [[nodiscard]] auto build_footprint() -> bool;
 
-  unsigned int soma_id_{};
+  [[nodiscard]] auto build_somas(const SWCModel& model) -> size_t;
 
-  unsigned int neurites_id_{};
+  [[nodiscard]] auto build_neurites(const SWCModel& model, const SceneConfig& config) -> bool;
 
-  Array<uint8_t> neurite_types_;
+  [[nodiscard]] auto build_clipped_neurites(const SWCModel& model,
+                                            const SceneConfig& config,
+                                            const Transform& t,
+                                            const ClipRect& clip) -> bool;
+
+  /**
+   * @brief Copies a neurite layout written by @ref SWCModel::write_neurite_geometry into the neurite geometry.
+   * */
+  [[nodiscard]] auto set_linear_neurites(const Vec4f* vertices,
+                                         const uint32_t* indices,
+                                         const uint8_t* types,
+                                         size_t num_segments) -> bool;
+
+  /**
+   * @brief Fits splines to the unbranched runs of a neurite layout and puts them in the neurite geometry.
+   * */
+  [[nodiscard]] auto set_curve_neurites(const Vec4f* vertices,
+                                        const uint32_t* indices,
+                                        const uint8_t* types,
+                                        size_t num_segments,
+                                        const SceneConfig& config) -> bool;
+
+  void commit(size_t num_somas, const SceneConfig& config);
+
+public:
+  /**
+   * @brief The geometry IDs within the instanced scene. These are the same for every model, so a hit can be
+   *        classified without knowing which model it belongs to.
+   * */
+  static constexpr unsigned int soma_id{ 0 };
+
+  static constexpr unsigned int neurites_id{ 1 };
+
+  static constexpr unsigned int short_neurites_id{ 2 };
+
+  NeuronGeometry(RTCDevice device);
+
+  ~NeuronGeometry();
+
+  NeuronGeometry(const NeuronGeometry&) = delete;
+
+  auto operator=(const NeuronGeometry&) -> NeuronGeometry& = delete;
+
+  [[nodiscard]] auto build(const SWCModel& model, const SceneConfig& config) -> bool;
+
+  /**
+   * @brief Builds the geometry with only the neurite segments that overlap a rectangle once they are placed with
+   *        the given transform. The soma is always built.
+   * */
+  [[nodiscard]] auto build(const SWCModel& model, const SceneConfig& config, const Transform& t, const ClipRect& clip)
+    -> bool;
+
+  [[nodiscard]] auto scene() const -> RTCScene { return scene_; }
+
+  /**
+   * @brief The soma, when it is a single node. Null when the soma is built from segments instead.
+   * */
+  [[nodiscard]] auto soma_sphere() const -> const Vec4f* { return soma_sphere_; }
+
+  /**
+   * @brief The soma segments, which are round linear curves, when the soma has more than one node.
+   * */
+  [[nodiscard]] auto soma_segments() const -> const CurveBuffers& { return soma_segments_; }
+
+  /**
+   * @brief The neurites, which are curves of the type given by @ref NeuronGeometry::neurite_curve.
+   * */
+  [[nodiscard]] auto neurites() const -> const CurveBuffers& { return neurite_buffers_; }
+
+  /**
+   * @brief The unbranched runs kept as round linear segments, see @ref NeuriteCurve::BSPLINE. Empty otherwise.
+   * */
+  [[nodiscard]] auto short_neurites() const -> const CurveBuffers& { return short_neurite_buffers_; }
+
+  [[nodiscard]] auto neurite_curve() const -> NeuriteCurve { return neurite_curve_; }
+
+  [[nodiscard]] auto model_bounds() const -> const RTCBounds& { return model_bounds_; }
+
+  [[nodiscard]] auto footprint() const -> const Array<RTCBounds>& { return footprint_; }
+
+  auto find_neurite_type(const unsigned int geom_id, const unsigned int primitive_id) const -> uint8_t
+  {
+    const auto num_primitives = (geom_id == short_neurites_id) ? num_short_neurites_ : num_neurites_;
+    const auto offset = (geom_id == short_neurites_id) ? num_neurites_ : 0;
+    assert(primitive_id < num_primitives);
+    return (primitive_id < num_primitives) ? neurite_types_[offset + primitive_id] : 0;
+  }
+};
+
+class Scene;
+
+/**
+ * @brief A coarse grid over the world XY plane that marks the cells the footprint of any primitive touches.
+ *
+ * @details Since the microscopes look straight down, a pixel whose area only covers unmarked cells cannot hit
+ *          anything and does not need to be traced.
+ * */
+class OccupancyGrid final
+{
+  Array<uint8_t> cells_;
+
+  size_t width_{};
+
+  size_t height_{};
+
+  float cell_size_{};
+
+  /**
+   * @brief The XY bounds of the scene. Nothing outside of them is occupied, even without cells.
+   * */
+  ClipRect bounds_;
+
+  bool empty_{ true };
+
+public:
+  /**
+   * @brief Builds the grid from the footprints of the neurons of a committed scene, placed in world space.
+   *
+   * @param resolution The number of cells along the longer side of the scene bounds. Zero only keeps the bounds.
+   * */
+  void build(const Scene& scene, size_t resolution);
+
+  void reset();
+
+  /**
+   * @brief Whether any primitive might overlap the rectangle. This is conservative, so a false positive only costs
+   *        some rays, while a false answer means that the rectangle is certainly empty.
+   * */
+  [[nodiscard]] auto may_overlap(const ClipRect& rect) const -> bool;
+
+private:
+  void mark(float lower_x, float lower_y, float upper_x, float upper_y);
+};
+
+/**
+ * @brief The ray tracing representation of one or more neurons.
+ *
+ * @details Each neuron is an Embree instance of the geometry of its model, so moving a neuron only costs a commit of
+ *          the top level scene, and neurons that share a model share its geometry. A scene can be built once and then
+ *          captured by any number of microscopes, as long as it is not changed while a capture is running.
+ * */
+class Scene final
+{
+  RTCDevice device_;
+
+  /**
+   * @brief The top level scene, which holds one instance per neuron. The geometry ID of each instance is its index.
+   * */
+  RTCScene scene_;
+
+  /**
+   * @brief The number of rays traced together by @ref Scene::intersect_down, from @ref native_ray_packet_size.
+   * */
+  size_t packet_size_;
+
+  /**
+   * @brief The geometry of a distinct model in the scene, along with the generation of the model it was built from.
+   * */
+  struct Prototype final
+  {
+    NeuronGeometry* geometry;
+
+    /**
+     * @brief Zero for clipped geometry, which belongs to a single instance.
+     * */
+    uint64_t generation;
+  };
+
+  Array<Prototype> prototypes_;
+
+  struct PrototypeIndexEntry final
+  {
+    uint64_t generation;
+
+    uint32_t prototype;
+  };
+
+  /**
+   * @brief An open addressing hash table from model generation to prototype, so adding a neuron does not depend on
+   *        the number of models in the scene. Its size is a power of two.
+   * */
+  Array<PrototypeIndexEntry> prototype_index_;
+
+  struct Instance final
+  {
+    RTCGeometry geometry;
+
+    uint32_t prototype;
+
+    Transform transform;
+  };
+
+  Array<Instance> instances_;
+
+  SceneConfig config_;
+
+  ClipRect clip_rect_;
+
+  bool clipped_{ false };
+
+  OccupancyGrid occupancy_;
 
 public:
   Scene(RTCDevice device);
 
   ~Scene();
 
+  Scene(const Scene&) = delete;
+
+  auto operator=(const Scene&) -> Scene& = delete;
+
+  /**
+   * @brief Sets the build options.
+   *
+   * @note The options apply to models added afterwards and to the top level from the next commit on.
+   * */
+  void set_config(const SceneConfig& config);
+
+  /**
+   * @brief Builds the scene from a single model, replacing whatever it was built from before.
+   * */
   [[nodiscard]] auto from_swc_model(const SWCModel& model, const Transform& t) -> bool;
 
-  [[nodiscard]] auto is_neurite(const unsigned int geom_id) const -> bool { return geom_id == neurites_id_; }
+  /**
+   * @brief Adds a neuron to the scene. The geometry of the model is only built the first time the model is added.
+   *
+   * @note The model is identified by its @ref SWCModel::generation, so a model that is loaded again gets new
+   *       geometry the next time it is added. The scene has to be committed before it is captured.
+   *
+   * @return The instance ID of the neuron, which is what RTCHit::instID reports, or RTC_INVALID_GEOMETRY_ID on failure.
+   * */
+  [[nodiscard]] auto add_neuron(const SWCModel& model, const Transform& t) -> unsigned int;
+
+  /**
+   * @brief Builds only the neurite segments that overlap the rectangle for neurons added from now on.
+   *
+   * @details A clipped neuron gets geometry of its own, since what is left of it depends on where it is placed.
+   *          Moving it with @ref Scene::set_transform does not clip it again.
+   * */
+  void set_clip_rect(const ClipRect& clip);
+
+  void clear_clip_rect();
+
+  /**
+   * @brief Moves a neuron. The neuron geometry is left as it is, only the scene has to be committed again.
+   *
+   * @return False if there is no neuron with the given instance ID.
+   * */
+  [[nodiscard]] auto set_transform(unsigned int instance_id, const Transform& t) -> bool;
+
+  /**
+   * @brief Commits the scene, and rebuilds the occupancy grid from where the neurons are now.
+   * */
+  void commit();
+
+  /**
+   * @brief Whether anything in the scene might overlap a rectangle of the world XY plane, as of the last commit.
+   * */
+  [[nodiscard]] auto may_overlap(const ClipRect& rect) const -> bool { return occupancy_.may_overlap(rect); }
+
+  /**
+   * @brief Removes all neurons and the geometry of their models. The clip rectangle is left as it is.
+   * */
+  void clear();
+
+  [[nodiscard]] auto num_neurons() const -> size_t { return instances_.size(); }
+
+  [[nodiscard]] auto num_prototypes() const -> size_t { return prototypes_.size(); }
+
+  /**
+   * @brief Gets the geometry of a neuron, in the local frame of its model.
+   * */
+  [[nodiscard]] auto neuron_geometry(const unsigned int instance_id) const -> const NeuronGeometry&
+  {
+    return *prototypes_[instances_[instance_id].prototype].geometry;
+  }
+
+  [[nodiscard]] auto neuron_transform(const unsigned int instance_id) const -> const Transform&
+  {
+    return instances_[instance_id].transform;
+  }
+
+  /**
+   * @brief Indicates whether a hit is on a neurite.
+   *
+   * @note The geometry ID should be the one in RTCHit, which refers to the geometry within the instanced scene.
+   * */
+  [[nodiscard]] auto is_neurite(const unsigned int geom_id) const -> bool
+  {
+    return (geom_id == NeuronGeometry::neurites_id) || (geom_id == NeuronGeometry::short_neurites_id);
+  }
 
   /**
    * @brief Gets the type of a neurite.
    *
-   * @note The primitive id should be the field in RTCHit when the geometry ID indicates that it is in fact a neurite.
+   * @note The IDs should be the fields in RTCHit when the geometry ID indicates that it is in fact a neurite. With
+   *       spline neurites, a primitive is a curve segment rather than an SWC edge.
    * */
-  auto find_neurite_type(const unsigned int primitive_id) const -> uint8_t
+  auto find_neurite_type(const unsigned int instance_id, const unsigned int geom_id, const unsigned int primitive_id)
+    const -> uint8_t
   {
-    assert(primitive_id < neurite_types_.size());
-    return (primitive_id < neurite_types_.size()) ? neurite_types_[primitive_id] : 0;
+    assert(instance_id < instances_.size());
+    return prototypes_[instances_[instance_id].prototype].geometry->find_neurite_type(geom_id, primitive_id);
   }
 
   auto intersect1(const Vec3f& org, const Vec3f& dir) const -> RTCRayHit
@@ -77,10 +547,44 @@ public:
     return ray_hit;
   }
 
+  /**
+   * @brief Traces rays straight down, along negative Z, which is how the microscopes look at the scene.
+   *
+   * @details The rays are traced in packets of @ref Scene::packet_size as coherent rays, so they should be close
+   *          together, like the samples of a pixel.
+   *
+   * @param points The XY position of each ray.
+   * @param count The number of rays.
+   * @param z The height the rays start at.
+   * @param geom_ids Receives the geometry ID of each hit, as in RTCHit, or RTC_INVALID_GEOMETRY_ID for a miss.
+   * @param distances Receives the distance to each hit. May be null.
+   * */
+  void intersect_down(const Vec2f* points, size_t count, float z, unsigned int* geom_ids, float* distances) const;
+
+  [[nodiscard]] auto packet_size() const -> size_t { return packet_size_; }
+
+private:
+  [[nodiscard]] auto find_prototype(uint64_t generation) const -> size_t;
+
+  /**
+   * @brief Adds the last prototype to the index, growing the index if it gets more than half full.
+   * */
+  [[nodiscard]] auto index_last_prototype() -> bool;
+
+public:
+
   auto get_bounds() const -> RTCBounds
   {
     RTCBounds bounds{};
     rtcGetSceneBounds(scene_, &bounds);
     return bounds;
   }
+
+  /**
+   * @brief The bounds the neurons would have if none of them were clipped, from the nodes of their models.
+   *
+   * @details Unlike @ref Scene::get_bounds, these do not depend on the clip rectangle, so anything derived from them
+   *          looks the same with and without clipping.
+   * */
+  [[nodiscard]] auto unclipped_bounds() const -> RTCBounds;
 };
@@ -1,107 +1,1191 @@
 #include "swc.h"
 
 #include "core.h"
+#include "mapped_file.h"
 
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include <omp.h>
+#include <zlib.h>
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 namespace {
 
-template<typename Callback>
-auto
-scan(FILE* file, Callback cb) -> bool
+[[nodiscard]] auto
+is_blank(const char c) -> bool
+{
+  return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+template<typename T>
+[[nodiscard]] auto
+parse_field(const char*& p, const char* end, T& value) -> bool
 {
-  if (fseek(file, 0, SEEK_SET) != 0) {
+  while ((p != end) && is_blank(*p)) {
+    p++;
+  }
+
+  // from_chars does not accept an explicit plus sign, but some writers emit one.
+  if ((p != end) && (*p == '+')) {
+    p++;
+  }
+
+  const auto result = std::from_chars(p, end, value);
+  if (result.ec != std::errc{}) {
     return false;
   }
 
-  char line_buffer[256];
+  p = result.ptr;
 
-  while (!feof(file)) {
+  return true;
+}
 
-    memset(line_buffer, 0, sizeof(line_buffer));
+/**
+ * @brief Parses SWC text in place, appending one node per data line.
+ *
+ * @note Blank lines and comment lines are skipped. Any columns after the seventh are ignored.
+ * */
+[[nodiscard]] auto
+parse(const char* p, const char* end, Array<SWCNode>& nodes) -> bool
+{
+  while (p != end) {
 
-    fgets(line_buffer, sizeof(line_buffer), file);
+    while ((p != end) && (is_blank(*p) || (*p == '\n'))) {
+      p++;
+    }
 
-    if ((line_buffer[0] == '#') || (line_buffer[0] == 0)) {
-      continue;
+    if (p == end) {
+      break;
     }
 
-    int id{};
-    int t{};
-    float x{};
-    float y{};
-    float z{};
-    float r{};
-    int parent{};
+    if (*p != '#') {
 
-    if (sscanf(line_buffer, "%d %d %f %f %f %f %d", &id, &t, &x, &y, &z, &r, &parent) != 7) {
-      return false;
+      int32_t id{};
+      int32_t type{};
+      float x{};
+      float y{};
+      float z{};
+      float r{};
+      int32_t parent{};
+
+      const auto ok = parse_field(p, end, id) && parse_field(p, end, type) && parse_field(p, end, x) &&
+                      parse_field(p, end, y) && parse_field(p, end, z) && parse_field(p, end, r) &&
+                      parse_field(p, end, parent);
+      if (!ok) {
+        return false;
+      }
+
+      auto* node = nodes.append();
+      if (!node) {
+        return false;
+      }
+
+      *node = SWCNode{ id, static_cast<SWCType>(type), Vec3f{ x, y, z }, r, parent };
     }
 
-    cb(id, t, x, y, z, r, parent);
+    while ((p != end) && (*p != '\n')) {
+      p++;
+    }
   }
 
   return true;
 }
 
+/**
+ * @brief Texts at least this large are split into chunks and parsed on all threads.
+ * */
+constexpr size_t parallel_parse_threshold{ 4 * 1024 * 1024 };
+
+/**
+ * @brief Data lines are rarely shorter than this, so reserving by it avoids regrowing for most texts.
+ * */
+constexpr size_t min_line_size{ 32 };
+
+[[nodiscard]] auto
+parse_serial(const char* begin, const char* end, Array<SWCNode>& nodes) -> bool
+{
+  const auto size = static_cast<size_t>(end - begin);
+
+  return nodes.reserve(nodes.size() + size / min_line_size + 1) && parse(begin, end, nodes);
+}
+
+/**
+ * @brief Splits the text into newline aligned chunks, parses them concurrently and appends the results in order.
+ *
+ * @note The nodes come out in the same order as with @ref parse_serial, so any sorting that follows behaves the same.
+ * */
+[[nodiscard]] auto
+parse_parallel(const char* begin, const char* end, Array<SWCNode>& nodes) -> bool
+{
+  const auto size = static_cast<size_t>(end - begin);
+
+  constexpr size_t min_chunk_size{ 1024 * 1024 };
+
+  auto num_chunks = static_cast<size_t>(omp_get_max_threads()) * 4;
+  if ((size / num_chunks) < min_chunk_size) {
+    num_chunks = size / min_chunk_size;
+  }
+
+  if (num_chunks < 2) {
+    return parse_serial(begin, end, nodes);
+  }
+
+  Array<const char*> bounds;
+  if (!bounds.resize(num_chunks + 1)) {
+    return false;
+  }
+
+  std::unique_ptr<Array<SWCNode>[]> chunks(new Array<SWCNode>[num_chunks]);
+
+  // Each boundary is moved forward to just past a newline, so that every chunk starts at the beginning of a line.
+  bounds[0] = begin;
+  bounds[num_chunks] = end;
+  for (size_t i = 1; i < num_chunks; i++) {
+    const auto* p = begin + (size * i) / num_chunks;
+    p = (p < bounds[i - 1]) ? bounds[i - 1] : p;
+    while ((p != end) && (p[-1] != '\n')) {
+      p++;
+    }
+    bounds[i] = p;
+  }
+
+  bool ok{ true };
+
+#pragma omp parallel for schedule(dynamic) reduction(&& : ok)
+
+  for (ssize_t i = 0; i < static_cast<ssize_t>(num_chunks); i++) {
+    ok = parse_serial(bounds[i], bounds[i + 1], chunks[i]) && ok;
+  }
+
+  size_t total{};
+
+  Array<size_t> offsets;
+  if (!offsets.resize(num_chunks)) {
+    ok = false;
+  }
+
+  for (size_t i = 0; ok && (i < num_chunks); i++) {
+    offsets[i] = total;
+    total += chunks[i].size();
+  }
+
+  const auto base = nodes.size();
+
+  ok = ok && nodes.resize(base + total);
+
+  if (ok) {
+#pragma omp parallel for
+
+    for (ssize_t i = 0; i < static_cast<ssize_t>(num_chunks); i++) {
+      if (chunks[i].size() > 0) {
+        memcpy(nodes.data() + base + offsets[i], chunks[i].data(), chunks[i].size() * sizeof(SWCNode));
+      }
+    }
+  }
+
+  return ok;
+}
+
+[[nodiscard]] auto
+parse_text(const char* begin, const char* end, Array<SWCNode>& nodes) -> bool
+{
+  const auto size = static_cast<size_t>(end - begin);
+
+  return ((size >= parallel_parse_threshold) && !omp_in_parallel()) ? parse_parallel(begin, end, nodes)
+                                                                     : parse_serial(begin, end, nodes);
+}
+
+[[nodiscard]] auto
+is_gzip(const char* data, const size_t size) -> bool
+{
+  return (size >= 2) && (static_cast<uint8_t>(data[0]) == 0x1f) && (static_cast<uint8_t>(data[1]) == 0x8b);
+}
+
+/**
+ * @brief Decompresses gzip data one window at a time, parsing the complete lines of each window as it goes.
+ *
+ * @details Only the window and the parsed nodes are held in memory. Windows are large enough to take the parallel
+ *          parsing path, and the partial line at the end of each window is carried over to the next one.
+ * */
+[[nodiscard]] auto
+parse_gzip(const char* data, const size_t size, Array<SWCNode>& nodes) -> bool
+{
+  constexpr size_t window_size{ 16 * 1024 * 1024 };
+
+  Array<char> window;
+  if (!window.resize(window_size)) {
+    return false;
+  }
+
+  z_stream stream{};
+
+  // 16 added to the window bits selects the gzip wrapper.
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    return false;
+  }
+
+  const auto* input = reinterpret_cast<const Bytef*>(data);
+
+  size_t consumed{};
+
+  size_t pending{};
+
+  bool done{ false };
+
+  bool ok{ true };
+
+  while (ok && !done) {
+
+    // The stream counts input in 32 bits, so very large files are fed in pieces.
+    if (stream.avail_in == 0) {
+      const auto remaining = size - consumed;
+      const auto piece = (remaining < 0x40000000u) ? remaining : 0x40000000u;
+      stream.next_in = const_cast<Bytef*>(input + consumed);
+      stream.avail_in = static_cast<uInt>(piece);
+      consumed += piece;
+    }
+
+    stream.next_out = reinterpret_cast<Bytef*>(window.data() + pending);
+    stream.avail_out = static_cast<uInt>(window_size - pending);
+
+    const auto status = inflate(&stream, Z_NO_FLUSH);
+
+    const auto has_input = (stream.avail_in > 0) || (consumed < size);
+
+    if (status == Z_STREAM_END) {
+      // Concatenated gzip members are read as one stream.
+      done = !has_input;
+      ok = done || (inflateReset(&stream) == Z_OK);
+    } else if ((status != Z_OK) && !((status == Z_BUF_ERROR) && has_input)) {
+      // Either the data is corrupt or it ends before the stream does.
+      ok = false;
+    }
+
+    const auto filled = window_size - stream.avail_out;
+
+    auto end = filled;
+    if (!done) {
+      while ((end > 0) && (window[end - 1] != '\n')) {
+        end--;
+      }
+      if ((end == 0) && (filled == window_size)) {
+        // A single line does not fit in the window.
+        ok = false;
+      }
+    }
+
+    ok = ok && parse_text(window.data(), window.data() + end, nodes);
+
+    pending = filled - end;
+
+    if (ok && (pending > 0)) {
+      memmove(window.data(), window.data() + end, pending);
+    }
+  }
+
+  inflateEnd(&stream);
+
+  return ok;
+}
+
+[[nodiscard]] auto
+hash_id(const int32_t id) -> size_t
+{
+  // Fibonacci hashing spreads consecutive IDs over the table.
+  return static_cast<size_t>((static_cast<uint64_t>(static_cast<uint32_t>(id)) * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+[[nodiscard]] auto
+is_sorted(const Array<SWCNode>& nodes) -> bool
+{
+  for (size_t i = 1; i < nodes.size(); i++) {
+    if (nodes[i].id < nodes[i - 1].id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+sort(Array<SWCNode>& nodes)
+{
+  auto cmp = [](const void* a, const void* b) -> int {
+    const auto id_a = static_cast<const SWCNode*>(a)->id;
+    const auto id_b = static_cast<const SWCNode*>(b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+  };
+
+  qsort(nodes.data(), nodes.size(), sizeof(SWCNode), cmp);
+}
+
+constexpr char binary_magic[8]{ 'N', 'S', 'S', 'W', 'C', 'B', 'I', 'N' };
+
+constexpr uint32_t binary_version{ 2 };
+
+constexpr uint32_t binary_byte_order{ 0x01020304u };
+
+struct BinaryHeader final
+{
+  char magic[8];
+
+  uint32_t version;
+
+  uint32_t byte_order;
+
+  uint64_t num_nodes;
+
+  uint8_t reserved[40];
+};
+
+// The header is a whole cache line, so that the columns that follow it in a mapped file keep their alignment.
+static_assert(sizeof(BinaryHeader) == cache_line_size);
+
+/**
+ * @brief The byte offset of each column within the column block.
+ * */
+struct ColumnLayout final
+{
+  size_t ids;
+
+  size_t types;
+
+  size_t x;
+
+  size_t y;
+
+  size_t z;
+
+  size_t radii;
+
+  size_t parents;
+
+  size_t parent_indices;
+
+  size_t size;
+};
+
+[[nodiscard]] auto
+column_layout(const size_t num_nodes) -> ColumnLayout
+{
+  size_t offset{};
+
+  auto next = [&offset, num_nodes](const size_t element_size) -> size_t {
+    const auto column = offset;
+    offset += (num_nodes * element_size + cache_line_size - 1) / cache_line_size * cache_line_size;
+    return column;
+  };
+
+  ColumnLayout layout{};
+  layout.ids = next(sizeof(int32_t));
+  layout.types = next(sizeof(SWCType));
+  layout.x = next(sizeof(float));
+  layout.y = next(sizeof(float));
+  layout.z = next(sizeof(float));
+  layout.radii = next(sizeof(float));
+  layout.parents = next(sizeof(int32_t));
+  layout.parent_indices = next(sizeof(uint32_t));
+  layout.size = offset;
+  return layout;
+}
+
+/**
+ * @brief The pre-order length from which the neurite geometry is counted and written concurrently.
+ * */
+constexpr ssize_t parallel_geometry_threshold{ 64 * 1024 };
+
+/**
+ * @brief The number of pre-order positions per chunk when writing the neurite geometry.
+ * */
+constexpr size_t geometry_chunk_size{ 16 * 1024 };
+
+/**
+ * @brief The last generation handed out to a model. Zero is never handed out.
+ * */
+std::atomic<uint64_t> last_generation{ 0 };
+
 } // namespace
 
 auto
-SWCModel::find_node(const int32_t id) const -> const SWCNode*
+SWCModel::find_node(const int32_t id, SWCNode* node) const -> bool
+{
+  const auto index = find_index(id);
+  if (index == invalid_index) {
+    return false;
+  }
+
+  *node = get_node(index);
+
+  return true;
+}
+
+auto
+SWCModel::find_index(const int32_t id) const -> size_t
 {
-  auto cmp_key = [](const void* key, const void* node) -> int {
-    return (*static_cast<const int32_t*>(key)) - static_cast<const SWCNode*>(node)->id;
+  if (dense_index_.size() > 0) {
+    const auto offset = static_cast<int64_t>(id) - min_id_;
+    if ((offset < 0) || (offset >= static_cast<int64_t>(dense_index_.size()))) {
+      return invalid_index;
+    }
+    return dense_index_[offset];
+  }
+
+  if (sparse_index_.size() == 0) {
+    return invalid_index;
+  }
+
+  const auto mask = sparse_index_.size() - 1;
+
+  for (auto slot = hash_id(id) & mask;; slot = (slot + 1) & mask) {
+    const auto& entry = sparse_index_[slot];
+    if (entry.index == invalid_index) {
+      return invalid_index;
+    }
+    if (entry.id == id) {
+      return entry.index;
+    }
+  }
+}
+
+auto
+SWCModel::get_node(const size_t index) const -> SWCNode
+{
+  return SWCNode{
+    ids_[index], types_[index], Vec3f{ x_[index], y_[index], z_[index] }, radii_[index], parents_[index]
   };
+}
+
+void
+SWCModel::compute_branch_orders(uint32_t* orders) const
+{
+  for (size_t i = 0; i < num_nodes_; i++) {
+    orders[i] = 0;
+  }
+
+  for (size_t k = 0; k < preorder_.size(); k++) {
+    const auto i = preorder_[k];
+    const auto parent = parent_indices_[i];
+    if ((parent == invalid_index) || (types_[i] == SWCType::SOMA)) {
+      orders[i] = 0;
+    } else if (types_[parent] == SWCType::SOMA) {
+      orders[i] = 1;
+    } else {
+      orders[i] = orders[parent] + (is_branch_point(parent) ? 1 : 0);
+    }
+  }
+}
+
+void
+SWCModel::compute_path_distances(float* distances) const
+{
+  for (size_t i = 0; i < num_nodes_; i++) {
+    distances[i] = 0.0F;
+  }
+
+  for (size_t k = 0; k < preorder_.size(); k++) {
+    const auto i = preorder_[k];
+    const auto parent = parent_indices_[i];
+    if (parent != invalid_index) {
+      const Vec3f delta{ x_[i] - x_[parent], y_[i] - y_[parent], z_[i] - z_[parent] };
+      distances[i] = distances[parent] + length(delta);
+    }
+  }
+}
+
+void
+SWCModel::compute_subtree_sizes(uint32_t* sizes) const
+{
+  for (size_t i = 0; i < num_nodes_; i++) {
+    sizes[i] = 1;
+  }
+
+  // Walking the pre-order backwards visits every child before its parent.
+  for (size_t k = preorder_.size(); k-- > 0;) {
+    const auto i = preorder_[k];
+    const auto parent = parent_indices_[i];
+    if (parent != invalid_index) {
+      sizes[parent] += sizes[i];
+    }
+  }
+}
+
+void
+SWCModel::count_neurite_geometry(size_t* num_segments, size_t* num_vertices) const
+{
+  size_t segments = 0;
+
+  size_t vertices = 0;
+
+  const auto order_size = static_cast<ssize_t>(preorder_.size());
+
+#pragma omp parallel for reduction(+ : segments, vertices) if (order_size >= parallel_geometry_threshold)
+
+  for (ssize_t k = 0; k < order_size; k++) {
+    const auto count = count_neurite_vertices(static_cast<size_t>(k));
+    segments += (count > 0) ? 1 : 0;
+    vertices += count;
+  }
+
+  *num_segments = segments;
+  *num_vertices = vertices;
+}
+
+auto
+SWCModel::write_neurite_geometry(Vec4f* vertices, uint32_t* indices, uint8_t* types) const -> bool
+{
+  /* The pre-order is cut into fixed size chunks. Each chunk is counted, a prefix sum over the counts gives the
+   * first segment and vertex of each chunk, and then the chunks are written concurrently. The chunks do not depend
+   * on the number of threads, and neither does the output.
+   */
+
+  const auto order_size = preorder_.size();
+
+  const auto num_chunks = (order_size + geometry_chunk_size - 1) / geometry_chunk_size;
+
+  Array<size_t> segment_offsets;
+
+  Array<size_t> vertex_offsets;
+
+  if (!segment_offsets.resize(num_chunks + 1) || !vertex_offsets.resize(num_chunks + 1)) {
+    return false;
+  }
+
+  const auto parallel = order_size >= parallel_geometry_threshold;
+
+#pragma omp parallel for if (parallel)
+
+  for (ssize_t c = 0; c < static_cast<ssize_t>(num_chunks); c++) {
+
+    const auto first = static_cast<size_t>(c) * geometry_chunk_size;
+    const auto last = (first + geometry_chunk_size < order_size) ? (first + geometry_chunk_size) : order_size;
+
+    size_t segments = 0;
+
+    size_t chunk_vertices = 0;
 
-  const void* result = bsearch(&id, nodes_.data(), nodes_.size(), sizeof(SWCNode), cmp_key);
+    for (size_t k = first; k < last; k++) {
+      const auto count = count_neurite_vertices(k);
+      segments += (count > 0) ? 1 : 0;
+      chunk_vertices += count;
+    }
+
+    segment_offsets[c + 1] = segments;
+    vertex_offsets[c + 1] = chunk_vertices;
+  }
+
+  segment_offsets[0] = 0;
+  vertex_offsets[0] = 0;
+
+  for (size_t c = 0; c < num_chunks; c++) {
+    segment_offsets[c + 1] += segment_offsets[c];
+    vertex_offsets[c + 1] += vertex_offsets[c];
+  }
+
+#pragma omp parallel for if (parallel)
+
+  for (ssize_t c = 0; c < static_cast<ssize_t>(num_chunks); c++) {
 
-  return static_cast<const SWCNode*>(result);
+    const auto first = static_cast<size_t>(c) * geometry_chunk_size;
+    const auto last = (first + geometry_chunk_size < order_size) ? (first + geometry_chunk_size) : order_size;
+
+    auto segment = segment_offsets[c];
+
+    auto vertex = vertex_offsets[c];
+
+    for (size_t k = first; k < last; k++) {
+      const auto count = count_neurite_vertices(k);
+      if (count == 0) {
+        continue;
+      }
+      const auto i = preorder_[k];
+      const auto parent = parent_indices_[i];
+      if (count == 2) {
+        vertices[vertex++] = Vec4f{ x_[parent], y_[parent], z_[parent], radii_[parent] };
+      }
+      indices[segment] = static_cast<uint32_t>(vertex - 1);
+      vertices[vertex++] = Vec4f{ x_[i], y_[i], z_[i], radii_[i] };
+      types[segment] = static_cast<uint8_t>(types_[i]);
+      segment++;
+    }
+  }
+
+  return true;
+}
+
+auto
+NeuriteGeometry::build(const SWCModel& model) -> bool
+{
+  size_t num_segments = 0;
+
+  size_t num_vertices = 0;
+
+  model.count_neurite_geometry(&num_segments, &num_vertices);
+
+  // Embree may read 16 bytes past the last vertex and index, so each array gets one spare element.
+  const auto padded = [](const size_t size) {
+    return (size + cache_line_size - 1) / cache_line_size * cache_line_size;
+  };
+
+  const auto vertices_size = padded((num_vertices + 1) * sizeof(Vec4f));
+  const auto indices_size = padded((num_segments + 4) * sizeof(uint32_t));
+  const auto types_size = padded(num_segments + 1);
+
+  if (!block_.allocate(vertices_size + indices_size + types_size)) {
+    return false;
+  }
+
+  auto* block = static_cast<uint8_t*>(block_.data());
+
+  auto* vertices = reinterpret_cast<Vec4f*>(block);
+  auto* indices = reinterpret_cast<uint32_t*>(block + vertices_size);
+  auto* types = block + vertices_size + indices_size;
+
+  if (!model.write_neurite_geometry(vertices, indices, types)) {
+    return false;
+  }
+
+  vertices_ = vertices;
+  indices_ = indices;
+  types_ = types;
+  num_segments_ = num_segments;
+  num_vertices_ = num_vertices;
+
+  return true;
+}
+
+auto
+SWCModel::share_geometry() -> bool
+{
+  std::shared_ptr<NeuriteGeometry> geometry(new (std::nothrow) NeuriteGeometry);
+
+  if (!geometry || !geometry->build(*this)) {
+    return false;
+  }
+
+  // Any previously shared geometry is only replaced once the new one is complete.
+  geometry_ = std::move(geometry);
+
+  return true;
+}
+
+auto
+SWCModel::is_neurite_segment(const size_t index) const -> bool
+{
+  return is_neurite_type(types_[index]) && (parent_indices_[index] != invalid_index);
+}
+
+auto
+SWCModel::count_neurite_vertices(const size_t k) const -> size_t
+{
+  const auto i = preorder_[k];
+  if (!is_neurite_segment(i)) {
+    return 0;
+  }
+  // A child that directly follows its parent in the pre-order continues the parent's run of vertices.
+  const auto parent = parent_indices_[i];
+  return ((k > 0) && (preorder_[k - 1] == parent) && is_neurite_segment(parent)) ? 1 : 2;
 }
 
 auto
 SWCModel::load_from_file(const char* path) -> bool
 {
-  auto* file = fopen(path, "r");
-  if (!file) {
+  if (is_pinned()) {
     return false;
   }
 
-  size_t num_nodes{};
+  MappedFile file;
+
+  if (!file.open(path)) {
+    return false;
+  }
+
+  return load_from_memory(file.data(), file.size());
+}
+
+auto
+SWCModel::load_from_memory(const char* text, const size_t size) -> bool
+{
+  if (is_pinned()) {
+    return false;
+  }
 
-  auto count_nodes = [&num_nodes](int, int, float, float, float, float, int) { num_nodes++; };
+  Array<SWCNode> nodes;
 
-  if (!scan(file, count_nodes)) {
+  const auto ok = is_gzip(text, size) ? parse_gzip(text, size, nodes) : parse_text(text, text + size, nodes);
+  if (!ok) {
     return false;
   }
 
-  if (!nodes_.resize(num_nodes)) {
+  nodes.shrink_to_fit();
+
+  return assign(nodes);
+}
+
+auto
+SWCModel::load_from_arrays(const size_t num_nodes,
+                           const int32_t* ids,
+                           const uint8_t* types,
+                           const float* positions,
+                           const float* radii,
+                           const int32_t* parents) -> bool
+{
+  if (is_pinned()) {
     return false;
   }
 
-  size_t index{};
+  bool sorted{ true };
+  for (size_t i = 1; sorted && (i < num_nodes); i++) {
+    sorted = ids[i - 1] <= ids[i];
+  }
 
-  auto init_nodes = [this, &index](int id, int type, float x, float y, float z, float r, int parent) {
-    nodes_[index] = SWCNode{ id, static_cast<SWCType>(type), Vec3f{ x, y, z }, r, parent };
-    index++;
-  };
+  if (!sorted) {
+    Array<SWCNode> nodes;
+    if (!nodes.resize(num_nodes)) {
+      return false;
+    }
+    for (size_t i = 0; i < num_nodes; i++) {
+      const auto* p = positions + i * 3;
+      nodes[i] = SWCNode{ ids[i], static_cast<SWCType>(types[i]), Vec3f{ p[0], p[1], p[2] }, radii[i], parents[i] };
+    }
+    return assign(nodes);
+  }
+
+  // Already sorted, so the arrays go straight into the columns.
 
-  if (!scan(file, init_nodes)) {
+  auto* columns = allocate_columns(num_nodes);
+  if (!columns && (num_nodes > 0)) {
     return false;
   }
 
-  auto cmp = [](const void* a, const void* b) -> int {
-    return static_cast<const SWCNode*>(a)->id - static_cast<const SWCNode*>(b)->id;
-  };
+  const auto layout = column_layout(num_nodes);
 
-  qsort(nodes_.data(), nodes_.size(), sizeof(SWCNode), cmp);
+  auto* x = reinterpret_cast<float*>(columns + layout.x);
+  auto* y = reinterpret_cast<float*>(columns + layout.y);
+  auto* z = reinterpret_cast<float*>(columns + layout.z);
 
-  return true;
+  if (num_nodes > 0) {
+    memcpy(columns + layout.ids, ids, num_nodes * sizeof(int32_t));
+    memcpy(columns + layout.types, types, num_nodes * sizeof(uint8_t));
+    memcpy(columns + layout.radii, radii, num_nodes * sizeof(float));
+    memcpy(columns + layout.parents, parents, num_nodes * sizeof(int32_t));
+  }
+
+  for (size_t i = 0; i < num_nodes; i++) {
+    x[i] = positions[i * 3 + 0];
+    y[i] = positions[i * 3 + 1];
+    z[i] = positions[i * 3 + 2];
+  }
+
+  return finish_columns(columns, num_nodes);
+}
+
+auto
+SWCModel::load_binary(const char* path) -> bool
+{
+  if (is_pinned()) {
+    return false;
+  }
+
+  // The mapping stays around as the model's storage, and is read through the index in no particular order.
+  MappedFile file(MappedFileAccess::NORMAL);
+
+  if (!file.open(path)) {
+    return false;
+  }
+
+  BinaryHeader header{};
+
+  if (file.size() < sizeof(header)) {
+    return false;
+  }
+
+  memcpy(&header, file.data(), sizeof(header));
+
+  if ((memcmp(header.magic, binary_magic, sizeof(binary_magic)) != 0) || (header.version != binary_version) ||
+      (header.byte_order != binary_byte_order) || (header.num_nodes >= invalid_index)) {
+    return false;
+  }
+
+  const auto num_nodes = static_cast<size_t>(header.num_nodes);
+
+  const auto layout = column_layout(num_nodes);
+
+  if ((file.size() - sizeof(header)) != layout.size) {
+    return false;
+  }
+
+  const auto* columns = reinterpret_cast<const uint8_t*>(file.data() + sizeof(header));
+
+  const auto* ids = reinterpret_cast<const int32_t*>(columns + layout.ids);
+  const auto* parent_indices = reinterpret_cast<const uint32_t*>(columns + layout.parent_indices);
+
+  // The columns are trusted as they are, except for what would make lookups or traversals go out of bounds.
+  for (size_t i = 0; i < num_nodes; i++) {
+    if (((i > 0) && (ids[i] < ids[i - 1])) ||
+        ((parent_indices[i] >= num_nodes) && (parent_indices[i] != invalid_index))) {
+      return false;
+    }
+  }
+
+  (void)storage_.allocate(0);
+  mapping_ = std::move(file);
+  set_columns(columns, num_nodes);
+
+  return build_index() && build_topology();
+}
+
+auto
+SWCModel::save_binary(const char* path) const -> bool
+{
+  /* The file is written next to the destination and then renamed over it. The destination may be the file this
+   * model is mapped from, which must not be truncated while the columns are read out of it, and a failed save
+   * leaves whatever was there before.
+   */
+
+  constexpr char suffix[]{ ".tmp" };
+
+  const auto path_size = strlen(path);
+
+  Array<char> temp_path;
+  if (!temp_path.resize(path_size + sizeof(suffix))) {
+    return false;
+  }
+
+  memcpy(temp_path.data(), path, path_size);
+  memcpy(temp_path.data() + path_size, suffix, sizeof(suffix));
+
+  auto* file = fopen(temp_path.data(), "wb");
+  if (!file) {
+    return false;
+  }
+
+  BinaryHeader header{};
+  memcpy(header.magic, binary_magic, sizeof(binary_magic));
+  header.version = binary_version;
+  header.byte_order = binary_byte_order;
+  header.num_nodes = num_nodes_;
+
+  auto ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  // The column block is zero filled when it is created, so it can be written out as is.
+  if (ok && (columns_size_ > 0)) {
+    ok = fwrite(columns_, columns_size_, 1, file) == 1;
+  }
+
+  ok = (fclose(file) == 0) && ok;
+
+  ok = ok && (rename(temp_path.data(), path) == 0);
+
+  if (!ok) {
+    (void)remove(temp_path.data());
+  }
+
+  return ok;
 }
 
 auto
 SWCModel::num_nodes() const -> size_t
 {
-  return nodes_.size();
+  return num_nodes_;
+}
+
+auto
+SWCModel::assign(Array<SWCNode>& nodes) -> bool
+{
+  // Most writers emit nodes in order, in which case there is nothing to sort.
+  if (!is_sorted(nodes)) {
+    sort(nodes);
+  }
+
+  const auto num_nodes = nodes.size();
+
+  auto* columns = allocate_columns(num_nodes);
+  if (!columns && (num_nodes > 0)) {
+    return false;
+  }
+
+  const auto layout = column_layout(num_nodes);
+
+  auto* ids = reinterpret_cast<int32_t*>(columns + layout.ids);
+  auto* types = reinterpret_cast<SWCType*>(columns + layout.types);
+  auto* x = reinterpret_cast<float*>(columns + layout.x);
+  auto* y = reinterpret_cast<float*>(columns + layout.y);
+  auto* z = reinterpret_cast<float*>(columns + layout.z);
+  auto* radii = reinterpret_cast<float*>(columns + layout.radii);
+  auto* parents = reinterpret_cast<int32_t*>(columns + layout.parents);
+
+  for (size_t i = 0; i < num_nodes; i++) {
+    const auto& node = nodes[i];
+    ids[i] = node.id;
+    types[i] = node.type;
+    x[i] = node.position[0];
+    y[i] = node.position[1];
+    z[i] = node.position[2];
+    radii[i] = node.radius;
+    parents[i] = node.parent;
+  }
+
+  return finish_columns(columns, num_nodes);
+}
+
+auto
+SWCModel::allocate_columns(const size_t num_nodes) -> uint8_t*
+{
+  mapping_.close();
+
+  set_columns(nullptr, 0);
+
+  if ((num_nodes >= invalid_index) || !storage_.allocate(column_layout(num_nodes).size)) {
+    return nullptr;
+  }
+
+  return static_cast<uint8_t*>(storage_.data());
+}
+
+auto
+SWCModel::finish_columns(uint8_t* columns, const size_t num_nodes) -> bool
+{
+  set_columns(columns, num_nodes);
+
+  if (!build_index()) {
+    return false;
+  }
+
+  const auto layout = column_layout(num_nodes);
+
+  auto* parent_indices = reinterpret_cast<uint32_t*>(columns + layout.parent_indices);
+
+  for (size_t i = 0; i < num_nodes; i++) {
+    parent_indices[i] = static_cast<uint32_t>(find_index(parents_[i]));
+  }
+
+  return build_topology();
+}
+
+void
+SWCModel::set_columns(const uint8_t* columns, const size_t num_nodes)
+{
+  const auto layout = column_layout(num_nodes);
+
+  columns_ = columns;
+  columns_size_ = columns ? layout.size : 0;
+  num_nodes_ = columns ? num_nodes : 0;
+  generation_ = ++last_generation;
+
+  ids_ = reinterpret_cast<const int32_t*>(columns + layout.ids);
+  types_ = reinterpret_cast<const SWCType*>(columns + layout.types);
+  x_ = reinterpret_cast<const float*>(columns + layout.x);
+  y_ = reinterpret_cast<const float*>(columns + layout.y);
+  z_ = reinterpret_cast<const float*>(columns + layout.z);
+  radii_ = reinterpret_cast<const float*>(columns + layout.radii);
+  parents_ = reinterpret_cast<const int32_t*>(columns + layout.parents);
+  parent_indices_ = reinterpret_cast<const uint32_t*>(columns + layout.parent_indices);
+
+  // The shared geometry was built from the previous columns. Scenes that still use it hold their own reference.
+  geometry_.reset();
+}
+
+auto
+SWCModel::build_index() -> bool
+{
+  (void)dense_index_.resize(0);
+  (void)sparse_index_.resize(0);
+  min_id_ = 0;
+
+  if (num_nodes_ == 0) {
+    return true;
+  }
+
+  // The nodes are sorted, so the ID range is known up front.
+  const auto min_id = static_cast<int64_t>(ids_[0]);
+  const auto range = static_cast<int64_t>(ids_[num_nodes_ - 1]) - min_id + 1;
+
+  // Most files number their nodes from one without gaps. A few holes are tolerated before switching to the hash table.
+  const auto max_dense_range = static_cast<int64_t>(num_nodes_) * 4 + 1024;
+
+  if (range <= max_dense_range) {
+
+    if (!dense_index_.resize(static_cast<size_t>(range))) {
+      return false;
+    }
+
+    min_id_ = static_cast<int32_t>(min_id);
+
+    for (size_t i = 0; i < dense_index_.size(); i++) {
+      dense_index_[i] = invalid_index;
+    }
+
+    // Walking backwards leaves the first of any duplicated IDs in the table.
+    for (size_t i = num_nodes_; i-- > 0;) {
+      dense_index_[static_cast<int64_t>(ids_[i]) - min_id] = static_cast<uint32_t>(i);
+    }
+
+  } else {
+
+    size_t capacity{ 16 };
+    while (capacity < (num_nodes_ * 2)) {
+      capacity *= 2;
+    }
+
+    if (!sparse_index_.resize(capacity)) {
+      return false;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+      sparse_index_[i] = SparseIndexEntry{ 0, static_cast<uint32_t>(invalid_index) };
+    }
+
+    const auto mask = capacity - 1;
+
+    for (size_t i = 0; i < num_nodes_; i++) {
+      const auto id = ids_[i];
+      for (auto slot = hash_id(id) & mask;; slot = (slot + 1) & mask) {
+        auto& entry = sparse_index_[slot];
+        if (entry.index == invalid_index) {
+          entry = SparseIndexEntry{ id, static_cast<uint32_t>(i) };
+          break;
+        }
+        if (entry.id == id) {
+          break;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+auto
+is_neurite_type(const SWCType type) -> bool
+{
+  switch (type) {
+    case SWCType::BASAL_DENDRITE:
+    case SWCType::APICAL_DENDRITE:
+    case SWCType::AXON:
+    case SWCType::UNSPECIFIED_NEURITE:
+      return true;
+    case SWCType::UNDEFINED:
+    case SWCType::CUSTOM:
+    case SWCType::SOMA:
+    case SWCType::GLIA_PROCESSES:
+      // TODO : glia processes
+      break;
+  }
+  return false;
+}
+
+auto
+load_many(const char* const* paths, const size_t count, SWCModel* models, bool* results) -> size_t
+{
+  size_t num_loaded{};
+
+  // File sizes vary a lot within a batch, so the files are handed out one at a time.
+#pragma omp parallel for schedule(dynamic) reduction(+ : num_loaded)
+
+  for (ssize_t i = 0; i < static_cast<ssize_t>(count); i++) {
+
+    const auto ok = models[i].load_from_file(paths[i]);
+
+    if (results) {
+      results[i] = ok;
+    }
+
+    num_loaded += ok ? 1 : 0;
+  }
+
+  return num_loaded;
+}
+
+auto
+convert_swc_to_binary(const char* swc_path, const char* binary_path) -> bool
+{
+  SWCModel model;
+
+  return model.load_from_file(swc_path) && model.save_binary(binary_path);
+}
+
+auto
+SWCModel::build_topology() -> bool
+{
+  if (!child_offsets_.resize(num_nodes_ + 1) || !children_.resize(num_nodes_) || !preorder_.resize(num_nodes_)) {
+    return false;
+  }
+
+  // Counting sort of the nodes by parent index. Filling in index order keeps each child list ascending.
+
+  for (size_t i = 0; i <= num_nodes_; i++) {
+    child_offsets_[i] = 0;
+  }
+
+  for (size_t i = 0; i < num_nodes_; i++) {
+    const auto parent = parent_indices_[i];
+    if (parent != invalid_index) {
+      child_offsets_[parent + 1]++;
+    }
+  }
+
+  for (size_t i = 0; i < num_nodes_; i++) {
+    child_offsets_[i + 1] += child_offsets_[i];
+  }
+
+  size_t num_children{};
+
+  for (size_t i = 0; i < num_nodes_; i++) {
+    const auto parent = parent_indices_[i];
+    if (parent != invalid_index) {
+      // The offset of the parent is used as a cursor and restored below.
+      children_[child_offsets_[parent]++] = static_cast<uint32_t>(i);
+      num_children++;
+    }
+  }
+
+  for (size_t i = num_nodes_; i > 0; i--) {
+    child_offsets_[i] = child_offsets_[i - 1];
+  }
+
+  if (num_nodes_ > 0) {
+    child_offsets_[0] = 0;
+  }
+
+  (void)children_.resize(num_children);
+
+  // An explicit stack, since real reconstructions are deep enough to overflow the call stack. The children are pushed
+  // in reverse so that they are visited in ascending order.
+
+  Array<uint32_t> stack;
+  if (!stack.reserve(num_nodes_)) {
+    return false;
+  }
+
+  size_t visited{};
+
+  for (size_t root = 0; root < num_nodes_; root++) {
+
+    if (parent_indices_[root] != invalid_index) {
+      continue;
+    }
+
+    *stack.append() = static_cast<uint32_t>(root);
+
+    while (stack.size() > 0) {
+      const auto i = stack[stack.size() - 1];
+      stack.pop_back();
+      preorder_[visited++] = i;
+      for (auto k = child_offsets_[i + 1]; k > child_offsets_[i]; k--) {
+        *stack.append() = children_[k - 1];
+      }
+    }
+  }
+
+  (void)preorder_.resize(visited);
+
+  return true;
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "core.h"
+#include "mapped_file.h"
+
+#include <memory>
 
 #include <stdint.h>
 
@@ -29,14 +32,372 @@ struct SWCNode final
   int32_t parent = 0;
 };
 
+/**
+ * @brief Whether nodes of this type are part of a neurite (an axon or a dendrite).
+ * */
+[[nodiscard]] auto
+is_neurite_type(SWCType type) -> bool;
+
+class SWCModel;
+
+/**
+ * @brief The neurite geometry of a model in the layout of @ref SWCModel::write_neurite_geometry, in one block that
+ *        is aligned and padded the way Embree needs it.
+ *
+ * @details Built by @ref SWCModel::share_geometry and never changed afterwards. Scenes that use it in place hold a
+ *          reference to it, so it stays valid when the model is loaded again or destroyed.
+ * */
+class NeuriteGeometry final
+{
+  AlignedBuffer block_;
+
+  const Vec4f* vertices_{};
+
+  const uint32_t* indices_{};
+
+  const uint8_t* types_{};
+
+  size_t num_segments_{};
+
+  size_t num_vertices_{};
+
+public:
+  [[nodiscard]] auto build(const SWCModel& model) -> bool;
+
+  /**
+   * @brief The vertices. There is one padding vertex past the last one.
+   * */
+  [[nodiscard]] auto vertices() const -> const Vec4f* { return vertices_; }
+
+  [[nodiscard]] auto indices() const -> const uint32_t* { return indices_; }
+
+  [[nodiscard]] auto types() const -> const uint8_t* { return types_; }
+
+  [[nodiscard]] auto num_segments() const -> size_t { return num_segments_; }
+
+  [[nodiscard]] auto num_vertices() const -> size_t { return num_vertices_; }
+};
+
+/**
+ * @brief A neuron morphology, stored as one 64-byte aligned array per field (structure of arrays).
+ *
+ * @details Nodes are sorted by ID and addressed by index. @ref SWCModel::get_node and @ref SWCModel::find_node give
+ *          an array of structures view of a single node for code that wants whole records.
+ * */
 class SWCModel final
 {
-  Array<SWCNode> nodes_;
+  AlignedBuffer storage_;
+
+  MappedFile mapping_;
+
+  /**
+   * @brief The block holding all of the columns. This is either the storage buffer or part of a mapped binary file.
+   * */
+  const uint8_t* columns_{};
+
+  size_t columns_size_{};
+
+  size_t num_nodes_{};
+
+  const int32_t* ids_{};
+
+  const SWCType* types_{};
+
+  const float* x_{};
+
+  const float* y_{};
+
+  const float* z_{};
+
+  const float* radii_{};
+
+  const int32_t* parents_{};
+
+  const uint32_t* parent_indices_{};
+
+  struct SparseIndexEntry final
+  {
+    int32_t id;
+
+    uint32_t index;
+  };
+
+  /**
+   * @brief Maps (id - min_id_) to a node index. Used when the IDs are reasonably dense.
+   * */
+  Array<uint32_t> dense_index_;
+
+  int32_t min_id_{};
+
+  /**
+   * @brief An open addressing hash table from ID to node index. Used when the IDs are too sparse for a dense table.
+   * */
+  Array<SparseIndexEntry> sparse_index_;
+
+  /**
+   * @brief The children of node i are children_[child_offsets_[i]] up to children_[child_offsets_[i + 1]].
+   * */
+  Array<uint32_t> child_offsets_;
+
+  Array<uint32_t> children_;
+
+  /**
+   * @brief A depth first pre-order of the nodes, so every parent comes before its children.
+   * */
+  Array<uint32_t> preorder_;
+
+  /**
+   * @brief The neurite geometry kept by @ref SWCModel::share_geometry. Null unless it has been called.
+   * */
+  std::shared_ptr<const NeuriteGeometry> geometry_;
+
+  /**
+   * @brief The number of outstanding @ref SWCModel::pin calls. Mutable, since views of a const model pin it too.
+   * */
+  mutable size_t num_pins_{};
+
+  /**
+   * @brief Identifies the data in the model. Every load gets a new one, unique across all models in the process.
+   * */
+  uint64_t generation_{};
 
 public:
-  [[nodiscard]] auto find_node(int32_t id) const -> const SWCNode*;
+  static constexpr size_t invalid_index{ 0xffffffffu };
+
+  /**
+   * @brief Marks the columns as being viewed from outside of the model. Loading into a pinned model fails instead
+   *        of freeing the columns under the views.
+   *
+   * @note The count is not atomic, so pinning has to be serialized with loading, as the Python bindings do.
+   * */
+  void pin() const { num_pins_++; }
+
+  void unpin() const { num_pins_--; }
 
+  [[nodiscard]] auto is_pinned() const -> bool { return num_pins_ > 0; }
+
+  /**
+   * @brief A token that changes whenever the model is loaded again. Two models with the same generation hold the
+   *        same data, which is what scenes use to share geometry between neurons, rather than the model address.
+   * */
+  [[nodiscard]] auto generation() const -> uint64_t { return generation_; }
+
+  /**
+   * @brief Copies the node with the given ID into @p node.
+   *
+   * @return True if the node exists, false otherwise.
+   * */
+  [[nodiscard]] auto find_node(int32_t id, SWCNode* node) const -> bool;
+
+  /**
+   * @brief Finds the index of the node with the given ID, in constant time.
+   *
+   * @return The index of the node or @ref SWCModel::invalid_index if there is no such node.
+   * */
+  [[nodiscard]] auto find_index(int32_t id) const -> size_t;
+
+  /**
+   * @brief Gets a node by its index. Indices run from zero to @ref SWCModel::num_nodes, in ID order.
+   * */
+  [[nodiscard]] auto get_node(size_t index) const -> SWCNode;
+
+  /**
+   * @brief Gets the index of the parent of a node, or @ref SWCModel::invalid_index if it has no parent in the model.
+   * */
+  [[nodiscard]] auto parent_index(const size_t index) const -> size_t { return parent_indices_[index]; }
+
+  [[nodiscard]] auto ids() const -> const int32_t* { return ids_; }
+
+  [[nodiscard]] auto types() const -> const SWCType* { return types_; }
+
+  [[nodiscard]] auto x() const -> const float* { return x_; }
+
+  [[nodiscard]] auto y() const -> const float* { return y_; }
+
+  [[nodiscard]] auto z() const -> const float* { return z_; }
+
+  [[nodiscard]] auto radii() const -> const float* { return radii_; }
+
+  /**
+   * @brief The parent ID of each node, as written in the source file.
+   * */
+  [[nodiscard]] auto parents() const -> const int32_t* { return parents_; }
+
+  /**
+   * @brief The parent index of each node, or @ref SWCModel::invalid_index for nodes without a parent in the model.
+   * */
+  [[nodiscard]] auto parent_indices() const -> const uint32_t* { return parent_indices_; }
+
+  [[nodiscard]] auto num_children(const size_t index) const -> size_t
+  {
+    return child_offsets_[index + 1] - child_offsets_[index];
+  }
+
+  /**
+   * @brief Gets the indices of the children of a node, in ascending order. There are @ref SWCModel::num_children.
+   * */
+  [[nodiscard]] auto children(const size_t index) const -> const uint32_t* { return &children_[child_offsets_[index]]; }
+
+  [[nodiscard]] auto is_branch_point(const size_t index) const -> bool { return num_children(index) > 1; }
+
+  [[nodiscard]] auto is_tip(const size_t index) const -> bool { return num_children(index) == 0; }
+
+  /**
+   * @brief Gets the node indices in depth first pre-order, starting from each root in index order.
+   *
+   * @note Nodes that are part of a parent cycle cannot be reached from a root and are left out.
+   * */
+  [[nodiscard]] auto preorder() const -> const uint32_t* { return preorder_.data(); }
+
+  [[nodiscard]] auto preorder_size() const -> size_t { return preorder_.size(); }
+
+  /**
+   * @brief Computes the centrifugal branch order of each node.
+   *
+   * @details Roots and soma nodes have order zero, stems leaving the soma have order one, and the order increases
+   *          by one past each branch point.
+   * */
+  void compute_branch_orders(uint32_t* orders) const;
+
+  /**
+   * @brief Computes the distance along the tree from each node to its root, which is normally the soma.
+   * */
+  void compute_path_distances(float* distances) const;
+
+  /**
+   * @brief Computes the number of nodes in the subtree rooted at each node, including the node itself.
+   * */
+  void compute_subtree_sizes(uint32_t* sizes) const;
+
+  /**
+   * @brief Counts the segments and vertices written by @ref SWCModel::write_neurite_geometry.
+   * */
+  void count_neurite_geometry(size_t* num_segments, size_t* num_vertices) const;
+
+  /**
+   * @brief Writes the neurites as round linear curve segments, one per neurite node with a parent.
+   *
+   * @details Segments are written in pre-order, so each unbranched run of nodes is a contiguous run of vertices and
+   *          segment s goes from vertex indices[s] to vertex indices[s] + 1. A segment whose parent node comes
+   *          right before it in the pre-order reuses the parent's vertex, the others start with a copy of it.
+   *          Both counting and writing run concurrently for large models, and the output does not depend on the
+   *          number of threads.
+   *
+   * @param vertices Receives the position and radius of each vertex.
+   * @param indices Receives the first vertex of each segment.
+   * @param types Receives the SWC type of each segment.
+   *
+   * @return False if the scratch space for the prefix sum could not be allocated.
+   * */
+  [[nodiscard]] auto write_neurite_geometry(Vec4f* vertices, uint32_t* indices, uint8_t* types) const -> bool;
+
+  /**
+   * @brief Keeps the neurite geometry in the model, aligned and padded the way Embree needs it, so that scenes can
+   *        use it in place instead of building a copy of their own.
+   *
+   * @note Loading new data into the model, or sharing again, drops the model's reference to the previous geometry.
+   *       Scenes that use it keep their own reference.
+   * */
+  [[nodiscard]] auto share_geometry() -> bool;
+
+  [[nodiscard]] auto has_shared_geometry() const -> bool { return geometry_ != nullptr; }
+
+  /**
+   * @brief The geometry kept by @ref SWCModel::share_geometry, or null.
+   * */
+  [[nodiscard]] auto shared_geometry() const -> const std::shared_ptr<const NeuriteGeometry>& { return geometry_; }
+
+  /**
+   * @note This and the other loaders fail without touching the model while it is pinned.
+   * */
   [[nodiscard]] auto load_from_file(const char* path) -> bool;
 
+  /**
+   * @brief Parses SWC text that is already in memory. The text does not need to be null terminated.
+   *
+   * @note Gzip compressed text is detected by its magic bytes and decompressed while it is parsed. The same goes for
+   *       @ref SWCModel::load_from_file, so .swc.gz files can be loaded directly.
+   * */
+  [[nodiscard]] auto load_from_memory(const char* text, size_t size) -> bool;
+
+  /**
+   * @brief Loads the model from one array per field.
+   *
+   * @param positions The x, y and z coordinates of each node, interleaved.
+   *
+   * @note The arrays are copied into the model, since the model has its own column layout.
+   * */
+  [[nodiscard]] auto load_from_arrays(size_t num_nodes,
+                                      const int32_t* ids,
+                                      const uint8_t* types,
+                                      const float* positions,
+                                      const float* radii,
+                                      const int32_t* parents) -> bool;
+
+  /**
+   * @brief Loads a model written by @ref SWCModel::save_binary.
+   *
+   * @details The file is memory mapped and the columns are used in place, so no parsing takes place.
+   *          The binary format is a 64 byte header (the magic "NSSWCBIN", a format version, a byte order
+   *          tag and the node count) followed by the columns, sorted by ID, each padded to 64 bytes.
+   * */
+  [[nodiscard]] auto load_binary(const char* path) -> bool;
+
+  [[nodiscard]] auto save_binary(const char* path) const -> bool;
+
   [[nodiscard]] auto num_nodes() const -> size_t;
+
+private:
+  /**
+   * @brief Replaces the model with the given nodes, sorting them by ID first if needed.
+   * */
+  [[nodiscard]] auto assign(Array<SWCNode>& nodes) -> bool;
+
+  /**
+   * @brief Replaces the model with zeroed storage for the given number of nodes.
+   *
+   * @return The column block to fill, or null if the storage could not be allocated.
+   * */
+  [[nodiscard]] auto allocate_columns(size_t num_nodes) -> uint8_t*;
+
+  /**
+   * @brief Builds the indices over storage columns that have been filled in, sorted by ID.
+   * */
+  [[nodiscard]] auto finish_columns(uint8_t* columns, size_t num_nodes) -> bool;
+
+  void set_columns(const uint8_t* columns, size_t num_nodes);
+
+  [[nodiscard]] auto build_index() -> bool;
+
+  [[nodiscard]] auto build_topology() -> bool;
+
+  /**
+   * @brief Whether the node is written as a neurite segment, which is a neurite node with a parent.
+   * */
+  [[nodiscard]] auto is_neurite_segment(size_t index) const -> bool;
+
+  /**
+   * @brief The number of vertices written for the node at the given pre-order position. That is zero for nodes
+   *        that are not segments, one for segments that continue the run before them and two otherwise.
+   * */
+  [[nodiscard]] auto count_neurite_vertices(size_t k) const -> size_t;
 };
+
+/**
+ * @brief Loads a batch of SWC files, parsing them concurrently on the OpenMP thread pool.
+ *
+ * @param paths The paths of the files to load.
+ * @param count The number of paths.
+ * @param models Receives one model per path.
+ * @param results Receives, per path, whether the model was loaded. May be null.
+ *
+ * @return The number of files that were loaded.
+ * */
+auto
+load_many(const char* const* paths, size_t count, SWCModel* models, bool* results) -> size_t;
+
+/**
+ * @brief Converts an SWC text file into the binary format read by @ref SWCModel::load_binary.
+ * */
+[[nodiscard]] auto
+convert_swc_to_binary(const char* swc_path, const char* binary_path) -> bool;
@@ -0,0 +1,156 @@
+#include "core.h"
+#include "microscope.h"
+#include "swc.h"
+#include "tissue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+constexpr size_t image_size{ 128 };
+
+constexpr float vertical_fov{ 100.0F };
+
+/**
+ * @brief Builds a soma with branches radiating out of it that are much thinner than a pixel, so most pixels along
+ *        them are only covered by some of their samples.
+ * */
+[[nodiscard]] auto
+make_thin_branches(SWCModel* model) -> bool
+{
+  constexpr size_t num_branches{ 48 };
+
+  constexpr size_t nodes_per_branch{ 12 };
+
+  constexpr float branch_radius{ 0.02F };
+
+  const auto num_nodes = 1 + num_branches * nodes_per_branch;
+
+  Array<int32_t> ids;
+  Array<uint8_t> types;
+  Array<float> positions;
+  Array<float> radii;
+  Array<int32_t> parents;
+
+  if (!ids.resize(num_nodes) || !types.resize(num_nodes) || !positions.resize(num_nodes * 3) ||
+      !radii.resize(num_nodes) || !parents.resize(num_nodes)) {
+    return false;
+  }
+
+  ids[0] = 1;
+  types[0] = static_cast<uint8_t>(SWCType::SOMA);
+  positions[0] = positions[1] = positions[2] = 0.0F;
+  radii[0] = 3.0F;
+  parents[0] = -1;
+
+  for (size_t i = 0; i < num_branches; i++) {
+
+    const auto angle = static_cast<float>(i) * (6.2831853F / static_cast<float>(num_branches));
+
+    for (size_t j = 0; j < nodes_per_branch; j++) {
+
+      const auto k = 1 + i * nodes_per_branch + j;
+
+      // The branches bend a little, so they cross pixels at every angle.
+      const auto r = 4.0F + static_cast<float>(j) * 3.8F;
+      const auto a = angle + static_cast<float>(j) * 0.03F;
+
+      ids[k] = static_cast<int32_t>(k + 1);
+      types[k] = static_cast<uint8_t>(SWCType::BASAL_DENDRITE);
+      positions[k * 3 + 0] = r * cosf(a);
+      positions[k * 3 + 1] = r * sinf(a);
+      positions[k * 3 + 2] = 0.0F;
+      radii[k] = branch_radius;
+      parents[k] = (j == 0) ? 1 : static_cast<int32_t>(k);
+    }
+  }
+
+  return model->load_from_arrays(num_nodes, ids.data(), types.data(), positions.data(), radii.data(), parents.data());
+}
+
+[[nodiscard]] auto
+capture_labels(const SWCModel& model, const SegmentationConfig& config, Array<uint8_t>* labels) -> bool
+{
+  SegmentationMicroscope microscope(image_size, image_size, vertical_fov);
+
+  microscope.set_config(config);
+
+  const Tissue tissue;
+
+  if (!microscope.capture(model, tissue, Transform{})) {
+    return false;
+  }
+
+  const auto& sensor = microscope.get_sensor();
+
+  if (!labels->resize(sensor.get_array_size())) {
+    return false;
+  }
+
+  memcpy(labels->data(), sensor.get_array_data(), sensor.get_array_size());
+
+  return true;
+}
+
+[[nodiscard]] auto
+count_covered(const Array<uint8_t>& labels) -> size_t
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < labels.size(); i += 3) {
+    count += (labels[i + 2] == 0) ? 1 : 0;
+  }
+
+  return count;
+}
+
+} // namespace
+
+/**
+ * @brief Checks that adaptive segmentation, with its default refinement, labels every pixel as the full trace does.
+ * */
+auto
+main() -> int
+{
+  SWCModel model;
+
+  if (!make_thin_branches(&model)) {
+    fprintf(stderr, "failed to build the model\n");
+    return EXIT_FAILURE;
+  }
+
+  SegmentationConfig full;
+
+  SegmentationConfig adaptive;
+  adaptive.adaptive = true;
+
+  Array<uint8_t> full_labels;
+
+  Array<uint8_t> adaptive_labels;
+
+  if (!capture_labels(model, full, &full_labels) || !capture_labels(model, adaptive, &adaptive_labels)) {
+    fprintf(stderr, "failed to capture the model\n");
+    return EXIT_FAILURE;
+  }
+
+  // The branches have to be there for the comparison to mean anything.
+  if (count_covered(full_labels) < image_size) {
+    fprintf(stderr, "the full trace only covers %zu pixels\n", count_covered(full_labels));
+    return EXIT_FAILURE;
+  }
+
+  size_t mismatches = 0;
+
+  for (size_t i = 0; i < full_labels.size(); i += 3) {
+    mismatches += (memcmp(&full_labels[i], &adaptive_labels[i], 3) != 0) ? 1 : 0;
+  }
+
+  if (mismatches > 0) {
+    fprintf(stderr, "%zu of %zu pixels are labeled differently\n", mismatches, full_labels.size() / 3);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}